@@ -0,0 +1,47 @@
+#!/bin/bash
+#
+# bench.sh - measure the proxy under load: starts tiny and the proxy on
+#     free ports and runs loadgen through the proxy against tiny, over
+#     objects created in tiny/bench.
+#
+#     usage: ./bench.sh [loadgen options]
+#     e.g.   PROXY_ARGS="-e" ./bench.sh -k -z 1.0 -c 32 -d 5
+#
+
+HOME_DIR=`pwd`
+MAX_PORT_TRIES=50
+
+# wait_for_port_use - spins until something accepts on the port, 5 seconds at most
+function wait_for_port_use() {
+    for i in `seq ${MAX_PORT_TRIES}`; do
+        (exec 3<>/dev/tcp/localhost/${1}) 2> /dev/null && return
+        sleep 0.1
+    done
+    echo "Timeout waiting for port ${1}"
+    exit 1
+}
+
+if [ ! -x ./proxy ] || [ ! -x ./loadgen ] || [ ! -x ./tiny/tiny ]; then
+    echo "Error: build proxy, loadgen and tiny/tiny first (make bench does)"
+    exit 1
+fi
+
+tiny_port=`bash ./free-port.sh`
+cd ./tiny
+./tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd ${HOME_DIR}
+wait_for_port_use ${tiny_port}
+
+proxy_port=`bash ./free-port.sh`
+./proxy ${PROXY_ARGS} ${proxy_port} &> /dev/null &
+proxy_pid=$!
+wait_for_port_use ${proxy_port}
+
+./loadgen -w ./tiny/bench "$@" ${proxy_port} localhost:${tiny_port}
+status=$?
+
+kill ${proxy_pid} ${tiny_pid} 2> /dev/null
+wait ${proxy_pid} ${tiny_pid} 2> /dev/null
+rm -rf ./tiny/bench
+exit ${status}
@@ -1,58 +1,687 @@
 #include <stdlib.h>
 #include "cache.h"
 #include "csapp.h"
+#include "disk.h"
+#include "gzip.h"
+#include "stats.h"
 
-Entry g_cache[ENTRY_SIZE];
+static Shard *g_shards;
+static int g_nshards;
+static const EvictionPolicy *g_policy;
 
-void CacheInit()
+static unsigned long HashUrl(const char *url, size_t url_len);
+static inline Shard *ShardOf(unsigned long hash);
+static Entry *Lookup(Shard *shard, const char *url, size_t url_len, unsigned long hash);
+static void LruUnlink(Shard *shard, Entry *entry);
+static void LruPushFront(Shard *shard, Entry *entry);
+static int Admit(Shard *shard, unsigned long hash, size_t object_len);
+static void Compress(Entry *entry);
+static size_t ChainPeek(Chain *chain, char *buf, size_t n);
+static void SpillToDisk(Entry *entry);
+static void Remove(Shard *shard, Entry *entry, int evicted);
+static void Evict(Shard *shard, Entry *entry);
+static Entry *LruVictim(Shard *shard);
+static void GdsfInsert(Shard *shard, Entry *entry);
+static void GdsfTouch(Shard *shard, Entry *entry);
+static void GdsfRemove(Shard *shard, Entry *entry, int evicted);
+static Entry *GdsfVictim(Shard *shard);
+static inline void GdsfPrioritize(Shard *shard, Entry *entry);
+static void HeapSet(Shard *shard, size_t i, Entry *entry);
+static void HeapSiftUp(Shard *shard, size_t i);
+static void HeapSiftDown(Shard *shard, size_t i);
+static Entry **CollectShard(Shard *shard, int *count);
+static int WriteRecord(FILE *fp, Entry *entry);
+static inline size_t SnapshotRecordSize(const SnapshotRecord *record);
+
+static const EvictionPolicy g_policies[] = {
+    {"lru", NULL, NULL, NULL, LruVictim},
+    {"gdsf", GdsfInsert, GdsfTouch, GdsfRemove, GdsfVictim},
+};
+
+void CacheInit(int nshards, const EvictionPolicy *policy)
 {
-    for (size_t i = 0; i < ENTRY_SIZE; i++) {
-        g_cache[i].url = NULL;
-        g_cache[i].object = NULL;
-        g_cache[i].object_len = 0;
+    if (nshards < 1) {
+        nshards = 1;
+    }
+    if (nshards > MAX_SHARDS) {
+        nshards = MAX_SHARDS;
+    }
+
+    g_policy = policy;
+    g_nshards = nshards;
+    g_shards = (Shard *)Calloc(nshards, sizeof(Shard));
+    for (int i = 0; i < nshards; i++) {
+        g_shards[i].capacity = MAX_CACHE_SIZE / nshards;
+        pthread_rwlock_init(&g_shards[i].lock, NULL);
+        pthread_mutex_init(&g_shards[i].lru_mutex, NULL);
+        SketchInit(&g_shards[i].sketch);
     }
 }
 
-void CacheObject(char *url, size_t url_len, char *object, size_t object_len)
+const EvictionPolicy *CachePolicy(char *name)
 {
-    int index = -1;
-    for (size_t i = 0; i < ENTRY_SIZE; i++) {
-        if (g_cache[i].url == NULL && g_cache[i].object == NULL) {
-            index = i;
-            break;
+    for (size_t i = 0; i < sizeof(g_policies) / sizeof(g_policies[0]); i++) {
+        if (strcmp(g_policies[i].name, name) == 0) {
+            return &g_policies[i];
         }
     }
+    return NULL;
+}
+
+void CacheObject(char *url, size_t url_len, Chain *object, const CacheMeta *meta)
+{
+    size_t object_len = object->len;
+    if (object_len > MAX_OBJECT_SIZE) {
+        ChainFree(object);
+        return;
+    }
+
+    Entry *entry = (Entry *)Malloc(sizeof(Entry));
+    entry->url = (char *)Malloc(url_len + 1);
+    memcpy(entry->url, url, url_len);
+    entry->url[url_len] = '\0';
+
+    ChainMove(&entry->object, object);
+    entry->meta = *meta;
+
+    /* the slow part, done before taking the lock */
+    Compress(entry);
+    entry->footprint = ChainFootprint(&entry->object) + ChainFootprint(&entry->identity_head);
+    object_len = EntrySize(entry);
+
+    unsigned long hash = HashUrl(url, url_len);
+    entry->hash = hash;
+    entry->refcnt = 1;
+
+    Shard *shard = ShardOf(hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    Entry *old = Lookup(shard, url, url_len, hash);
+    if (old != NULL) {
+        Evict(shard, old);
+    } else if (!Admit(shard, hash, object_len)) {
+        /* not worth memory, but still worth more than a refetch */
+        pthread_rwlock_unlock(&shard->lock);
+        StatsAdd(STAT_CACHE_REJECTS, 1);
+        SpillToDisk(entry);
+        ReleaseObject(entry);
+        return;
+    }
 
-    /* for convience, just evict first, not implement LRU */
-    if (index == -1) {
-        index = 0;
-        Free(g_cache[index].url);
-        Free(g_cache[index].object);
+    /* evict entries in policy order until the new object fits */
+    Entry *evicted = NULL;
+    Entry *victim;
+    while (shard->size + object_len > shard->capacity && (victim = g_policy->victim(shard)) != NULL) {
+        Remove(shard, victim, 1);
+        StatsAdd(STAT_CACHE_EVICTIONS, 1);
+        StatsAdd(STAT_CACHE_EVICTED_BYTES, EntrySize(victim));
+        victim->hnext = evicted;
+        evicted = victim;
     }
-    
-    g_cache[index].url = (char *)Malloc(url_len + 1);            
-    memcpy(g_cache[index].url, url, url_len);
-    g_cache[index].url[url_len] = '\0';
 
-    g_cache[index].object = (char *)Malloc(object_len);
-    memcpy(g_cache[index].object, object, object_len);
+    Entry **bucket = &shard->buckets[hash & (SHARD_BUCKETS - 1)];
+    entry->hnext = *bucket;
+    *bucket = entry;
+
+    LruPushFront(shard, entry);
+    shard->size += object_len;
+    if (g_policy->insert != NULL) {
+        g_policy->insert(shard, entry);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    StatsAdd(STAT_CACHE_INSERTS, 1);
 
-    g_cache[index].object_len = object_len;
+    /* evicted objects move down to the disk tier, outside the shard lock */
+    while (evicted != NULL) {
+        Entry *victim = evicted;
+        evicted = victim->hnext;
+        SpillToDisk(victim);
+        ReleaseObject(victim);
+    }
 }
 
-char *FindObejct(char *url, size_t *object_len)
+Entry *FindObejct(char *url)
 {
-    for (size_t i = 0; i < ENTRY_SIZE; i++) {
-        if (g_cache[i].url == NULL) {
-            continue;
+    size_t url_len = strlen(url);
+    unsigned long hash = HashUrl(url, url_len);
+    Shard *shard = ShardOf(hash);
+    SketchIncrement(&shard->sketch, hash);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    Entry *entry = Lookup(shard, url, url_len, hash);
+    if (entry != NULL) {
+        __atomic_add_fetch(&entry->refcnt, 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&shard->lru_mutex);
+        LruUnlink(shard, entry);
+        LruPushFront(shard, entry);
+        if (g_policy->touch != NULL) {
+            g_policy->touch(shard, entry);
         }
-        
-        if (strcmp(url, g_cache[i].url) == 0) {
+        pthread_mutex_unlock(&shard->lru_mutex);
+    }
+    pthread_rwlock_unlock(&shard->lock);
 
-            *object_len = g_cache[i].object_len;
-            return g_cache[i].object;
+    return entry;
+}
+
+void ReleaseObject(Entry *entry)
+{
+    if (__atomic_sub_fetch(&entry->refcnt, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    Free(entry->url);
+    ChainFree(&entry->object);
+    ChainFree(&entry->identity_head);
+    Free(entry);
+}
+
+size_t CacheUsage(void)
+{
+    size_t size = 0;
+    for (int i = 0; i < g_nshards; i++) {
+        pthread_rwlock_rdlock(&g_shards[i].lock);
+        size += g_shards[i].size;
+        pthread_rwlock_unlock(&g_shards[i].lock);
+    }
+    return size;
+}
+
+void CacheMetaInit(CacheMeta *meta, const ResponseHead *head)
+{
+    meta->framed = ResponseFramed(head);
+    meta->expires = time(NULL) + ResponseFreshness(head);
+    strcpy(meta->etag, head->etag);
+    strcpy(meta->last_modified, head->last_modified);
+}
+
+int CacheFresh(const Entry *entry)
+{
+    return time(NULL) < entry->meta.expires;
+}
+
+int CacheIdentity(Entry *entry, Chain *out)
+{
+    if (!entry->compressed) {
+        for (Chunk *chunk = entry->object.head; chunk != NULL; chunk = chunk->next) {
+            ChainAppend(out, chunk->data, chunk->len);
         }
+        return 0;
+    }
+    for (Chunk *chunk = entry->identity_head.head; chunk != NULL; chunk = chunk->next) {
+        ChainAppend(out, chunk->data, chunk->len);
     }
+    return GunzipChain(&entry->object, entry->body_off, out);
+}
+
+int CacheSnapshot(char *path)
+{
+    char tmp[MAXLINE];
+    snprintf(tmp, MAXLINE, "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    for (int i = 0; i < g_nshards; i++) {
+        /* entries are written from references, no shard lock is held meanwhile */
+        int count;
+        Entry **entries = CollectShard(&g_shards[i], &count);
+        for (int j = 0; j < count; j++) {
+            /* an entry that can not be written out is left behind, not the snapshot */
+            int rc = ok ? WriteRecord(fp, entries[j]) : -1;
+            ok = rc >= 0;
+            header.count += rc > 0;
+            ReleaseObject(entries[j]);
+        }
+        Free(entries);
+    }
+
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return header.count;
+}
+
+int CacheRestore(char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    SnapshotHeader *header = (SnapshotHeader *)base;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SNAPSHOT_VERSION) {
+        Munmap(base, size);
+        return -1;
+    }
+
+    int loaded = 0;
+    size_t off = sizeof(SnapshotHeader);
+    for (uint32_t i = 0; i < header->count; i++) {
+        /* a truncated or corrupt tail is dropped, not trusted */
+        SnapshotRecord *record = (SnapshotRecord *)(base + off);
+        if (off + sizeof(SnapshotRecord) > size || off + SnapshotRecordSize(record) > size ||
+            record->etag_len >= MAX_VALIDATOR || record->last_modified_len >= MAX_VALIDATOR) {
+            break;
+        }
+
+        char *url = (char *)(record + 1);
+        char *etag = url + record->url_len;
+        char *last_modified = etag + record->etag_len;
+        char *data = last_modified + record->last_modified_len;
+
+        CacheMeta meta;
+        meta.framed = record->framed;
+        meta.expires = record->expires;
+        memcpy(meta.etag, etag, record->etag_len);
+        meta.etag[record->etag_len] = '\0';
+        memcpy(meta.last_modified, last_modified, record->last_modified_len);
+        meta.last_modified[record->last_modified_len] = '\0';
+
+        Chain object;
+        ChainInit(&object);
+        ChainAppend(&object, data, record->object_len);
+        CacheObject(url, record->url_len, &object, &meta);
+
+        loaded++;
+        off += SnapshotRecordSize(record);
+    }
+
+    Munmap(base, size);
+    return loaded;
+}
+
+/**
+ * @return referenced entries of shard, least recently used first, drop each
+ * with ReleaseObject and the array with Free
+ */
+static Entry **CollectShard(Shard *shard, int *count)
+{
+    pthread_rwlock_rdlock(&shard->lock);
+    pthread_mutex_lock(&shard->lru_mutex);
+    int n = 0;
+    for (Entry *entry = shard->lru_tail; entry != NULL; entry = entry->prev) {
+        n++;
+    }
+    Entry **entries = (Entry **)Malloc((n + 1) * sizeof(Entry *));
+    n = 0;
+    for (Entry *entry = shard->lru_tail; entry != NULL; entry = entry->prev) {
+        __atomic_add_fetch(&entry->refcnt, 1, __ATOMIC_RELAXED);
+        entries[n++] = entry;
+    }
+    pthread_mutex_unlock(&shard->lru_mutex);
+    pthread_rwlock_unlock(&shard->lock);
+
+    *count = n;
+    return entries;
+}
+
+/**
+ * @return 1 if entry was written, 0 if it was skipped because its response
+ * could not be rebuilt, -1 on a write error
+ */
+static int WriteRecord(FILE *fp, Entry *entry)
+{
+    /* snapshots hold responses as received, they are compressed again on load */
+    Chain identity;
+    ChainInit(&identity);
+    if (CacheIdentity(entry, &identity) < 0) {
+        ChainFree(&identity);
+        return 0;
+    }
+
+    SnapshotRecord record;
+    memset(&record, 0, sizeof(record));
+    record.url_len = strlen(entry->url);
+    record.object_len = identity.len;
+    record.etag_len = strlen(entry->meta.etag);
+    record.last_modified_len = strlen(entry->meta.last_modified);
+    record.framed = entry->meta.framed;
+    record.expires = entry->meta.expires;
+
+    static const char pad[8];
+    size_t len = sizeof(record) + record.url_len + record.etag_len + record.last_modified_len +
+                 record.object_len;
+    int ok = fwrite(&record, sizeof(record), 1, fp) == 1 &&
+             fwrite(entry->url, 1, record.url_len, fp) == record.url_len &&
+             fwrite(entry->meta.etag, 1, record.etag_len, fp) == record.etag_len &&
+             fwrite(entry->meta.last_modified, 1, record.last_modified_len, fp) == record.last_modified_len;
+    for (Chunk *chunk = identity.head; ok && chunk != NULL; chunk = chunk->next) {
+        ok = fwrite(chunk->data, 1, chunk->len, fp) == chunk->len;
+    }
+    ok = ok && fwrite(pad, 1, SnapshotRecordSize(&record) - len, fp) == SnapshotRecordSize(&record) - len;
+    ChainFree(&identity);
+    return ok ? 1 : -1;
+}
+
+/**
+ * @brief records are 8 byte aligned so their headers can be read in place
+ */
+static inline size_t SnapshotRecordSize(const SnapshotRecord *record)
+{
+    size_t len = sizeof(SnapshotRecord) + record->url_len + record->etag_len +
+                 record->last_modified_len + record->object_len;
+    return (len + 7) & ~(size_t)7;
+}
+
+/**
+ * FNV-1a
+ */
+static unsigned long HashUrl(const char *url, size_t url_len)
+{
+    unsigned long hash = 14695981039346656037UL;
+    for (size_t i = 0; i < url_len; i++) {
+        hash ^= (unsigned char)url[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/**
+ * low bits of hash select the bucket, so pick the shard with high bits
+ */
+static inline Shard *ShardOf(unsigned long hash)
+{
+    return &g_shards[(hash >> 32) % g_nshards];
+}
 
+static Entry *Lookup(Shard *shard, const char *url, size_t url_len, unsigned long hash)
+{
+    Entry *entry = shard->buckets[hash & (SHARD_BUCKETS - 1)];
+    for (; entry != NULL; entry = entry->hnext) {
+        if (entry->hash == hash && strncmp(entry->url, url, url_len) == 0 &&
+            entry->url[url_len] == '\0') {
+            return entry;
+        }
+    }
     return NULL;
-}
\ No newline at end of file
+}
+
+static void LruUnlink(Shard *shard, Entry *entry)
+{
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        shard->lru_head = entry->next;
+    }
+
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        shard->lru_tail = entry->prev;
+    }
+}
+
+static void LruPushFront(Shard *shard, Entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->lru_head;
+    if (shard->lru_head != NULL) {
+        shard->lru_head->prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+/**
+ * @brief TinyLFU admission: an object that does not fit as is must be more
+ * popular than the entry the policy would evict first. caller must hold the
+ * shard's write lock
+ */
+static int Admit(Shard *shard, unsigned long hash, size_t object_len)
+{
+    Entry *victim;
+    if (shard->size + object_len <= shard->capacity || (victim = g_policy->victim(shard)) == NULL) {
+        return 1;
+    }
+    return SketchEstimate(&shard->sketch, hash) > SketchEstimate(&shard->sketch, victim->hash);
+}
+
+/**
+ * @brief gzip a complete textual 200 response if that saves enough, keeping
+ * its header as received in identity_head. both headers get a Vary so
+ * downstream caches keep the two apart
+ */
+static void Compress(Entry *entry)
+{
+    entry->compressed = 0;
+    ChainInit(&entry->identity_head);
+    if (entry->object.len < GZIP_MIN_SIZE) {
+        return;
+    }
+
+    char head[MAXBUF + 1];
+    size_t n = ChainPeek(&entry->object, head, MAXBUF);
+    head[n] = '\0';
+    char *end = strstr(head, "\r\n\r\n");
+    if (end == NULL) {
+        return;
+    }
+    size_t head_len = end + 4 - head;
+    size_t body_len = entry->object.len - head_len;
+
+    ResponseHead parsed;
+    if (!ParseResponseBuffer(head, head_len, &parsed) || parsed.status != 200 ||
+        parsed.content_length != (long)body_len || parsed.chunked || parsed.encoded ||
+        !parsed.textual || parsed.vary || body_len < GZIP_MIN_SIZE) {
+        return;
+    }
+
+    Chain body;
+    ChainInit(&body);
+    if (GzipChain(&entry->object, head_len, &body) < 0 ||
+        body.len * GZIP_MIN_SAVING > body_len * (GZIP_MIN_SAVING - 1)) {
+        ChainFree(&body);
+        return;
+    }
+
+    /* the header as received, and the same one but for the length */
+    char extra[MAXLINE];
+    int extra_len = snprintf(extra, MAXLINE, "Vary: Accept-Encoding\r\n\r\n");
+    ChainAppend(&entry->identity_head, head, end + 2 - head);
+    ChainAppend(&entry->identity_head, extra, extra_len);
+
+    Chain object;
+    ChainInit(&object);
+    for (char *line = head; line < end + 2;) {
+        char *eol = strstr(line, "\r\n") + 2;
+        if (line == head || strncasecmp(line, "Content-Length:", 15) != 0) {
+            ChainAppend(&object, line, eol - line);
+        }
+        line = eol;
+    }
+    extra_len = snprintf(extra, MAXLINE, "Content-Encoding: gzip\r\nContent-Length: %zu\r\n"
+                         "Vary: Accept-Encoding\r\n\r\n", body.len);
+    ChainAppend(&object, extra, extra_len);
+    entry->body_off = object.len;
+    for (Chunk *chunk = body.head; chunk != NULL; chunk = chunk->next) {
+        ChainAppend(&object, chunk->data, chunk->len);
+    }
+    ChainFree(&body);
+
+    ChainFree(&entry->object);
+    ChainMove(&entry->object, &object);
+    entry->compressed = 1;
+}
+
+/**
+ * @brief copy the first n bytes of chain, or all of it if shorter, to buf
+ * @return bytes copied
+ */
+static size_t ChainPeek(Chain *chain, char *buf, size_t n)
+{
+    size_t copied = 0;
+    for (Chunk *chunk = chain->head; chunk != NULL && copied < n; chunk = chunk->next) {
+        size_t cnt = chunk->len < n - copied ? chunk->len : n - copied;
+        memcpy(buf + copied, chunk->data, cnt);
+        copied += cnt;
+    }
+    return copied;
+}
+
+/**
+ * @brief the disk tier sends objects with sendfile, so it keeps them as
+ * received
+ */
+static void SpillToDisk(Entry *entry)
+{
+    if (!entry->compressed) {
+        DiskStore(entry->url, strlen(entry->url), &entry->object, &entry->meta);
+        return;
+    }
+
+    Chain identity;
+    ChainInit(&identity);
+    if (CacheIdentity(entry, &identity) == 0) {
+        DiskStore(entry->url, strlen(entry->url), &identity, &entry->meta);
+    }
+    ChainFree(&identity);
+}
+
+/**
+ * @brief remove entry from hash table, LRU list and policy of shard, the
+ * cache's reference to it is left to the caller. caller must hold the shard's
+ * write lock
+ * @param evicted 1 if entry makes room for another, 0 if it is replaced
+ */
+static void Remove(Shard *shard, Entry *entry, int evicted)
+{
+    Entry **link = &shard->buckets[entry->hash & (SHARD_BUCKETS - 1)];
+    while (*link != entry) {
+        link = &(*link)->hnext;
+    }
+    *link = entry->hnext;
+
+    LruUnlink(shard, entry);
+    shard->size -= EntrySize(entry);
+    if (g_policy->remove != NULL) {
+        g_policy->remove(shard, entry, evicted);
+    }
+}
+
+/**
+ * @brief remove replaced entry from shard and drop the cache's reference to
+ * it. caller must hold the shard's write lock
+ */
+static void Evict(Shard *shard, Entry *entry)
+{
+    Remove(shard, entry, 0);
+    ReleaseObject(entry);
+}
+
+static Entry *LruVictim(Shard *shard)
+{
+    return shard->lru_tail;
+}
+
+static void GdsfInsert(Shard *shard, Entry *entry)
+{
+    if (shard->heap_len == shard->heap_cap) {
+        shard->heap_cap = shard->heap_cap ? 2 * shard->heap_cap : 64;
+        shard->heap = (Entry **)Realloc(shard->heap, shard->heap_cap * sizeof(Entry *));
+    }
+    entry->frequency = 1;
+    GdsfPrioritize(shard, entry);
+    HeapSet(shard, shard->heap_len++, entry);
+    HeapSiftUp(shard, entry->heap_index);
+}
+
+static void GdsfTouch(Shard *shard, Entry *entry)
+{
+    entry->frequency++;
+    GdsfPrioritize(shard, entry);
+    HeapSiftDown(shard, entry->heap_index);  // priority only grows
+}
+
+static void GdsfRemove(Shard *shard, Entry *entry, int evicted)
+{
+    /* inflate the clock so entries cached from now on outrank stale popularity */
+    if (evicted) {
+        shard->clock = entry->priority;
+    }
+
+    Entry *last = shard->heap[--shard->heap_len];
+    if (last != entry) {
+        HeapSet(shard, entry->heap_index, last);
+        HeapSiftUp(shard, last->heap_index);
+        HeapSiftDown(shard, last->heap_index);
+    }
+}
+
+static Entry *GdsfVictim(Shard *shard)
+{
+    return shard->heap_len > 0 ? shard->heap[0] : NULL;
+}
+
+/**
+ * @brief H = L + frequency * cost / size with a cost of 1 per object, which
+ * maximizes the object hit ratio
+ */
+static inline void GdsfPrioritize(Shard *shard, Entry *entry)
+{
+    size_t size = EntrySize(entry) > 0 ? EntrySize(entry) : 1;
+    entry->priority = shard->clock + (double)entry->frequency / size;
+}
+
+static void HeapSet(Shard *shard, size_t i, Entry *entry)
+{
+    shard->heap[i] = entry;
+    entry->heap_index = i;
+}
+
+static void HeapSiftUp(Shard *shard, size_t i)
+{
+    Entry *entry = shard->heap[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (shard->heap[parent]->priority <= entry->priority) {
+            break;
+        }
+        HeapSet(shard, i, shard->heap[parent]);
+        i = parent;
+    }
+    HeapSet(shard, i, entry);
+}
+
+static void HeapSiftDown(Shard *shard, size_t i)
+{
+    Entry *entry = shard->heap[i];
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= shard->heap_len) {
+            break;
+        }
+        if (child + 1 < shard->heap_len && shard->heap[child + 1]->priority < shard->heap[child]->priority) {
+            child++;
+        }
+        if (entry->priority <= shard->heap[child]->priority) {
+            break;
+        }
+        HeapSet(shard, i, shard->heap[child]);
+        i = child;
+    }
+    HeapSet(shard, i, entry);
+}
@@ -2,24 +2,200 @@
 #define CACHE_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "chunk.h"
+#include "http.h"
+#include "sketch.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
 /**
- * not implement LRU, not limit MAX_OBJECT_SIZE
- * just an cache-array of length 10, and evict first element in array.
+ * the cache is partitioned into shards selected by the hash of url, each
+ * shard owns a chained hash table, a doubly linked LRU list (head is the most
+ * recently used) and an equal part of MAX_CACHE_SIZE. entries are evicted to
+ * make room for new objects in the order of the eviction policy chosen at
+ * startup: "lru" evicts from the tail of the LRU list, "gdsf" (greedy dual
+ * size frequency) evicts the entry with the lowest frequency / size plus an
+ * inflation clock, keeping many small popular objects over a few big ones.
+ * the LRU list is kept whatever the policy, snapshots are written in its
+ * order.
+ *
+ * a new object is not admitted unconditionally though (TinyLFU): every lookup
+ * is counted in the shard's frequency sketch, and an object that would evict
+ * entries is only cached if it was looked up more often than the policy's
+ * first victim, so a scan of one-off urls can not flush the hot entries.
+ * objects turned down go straight to the disk tier.
+ *
+ * every shard's hash table is guarded by its own reader-writer lock, so
+ * lookups run in parallel and inserts/evictions only exclude the one shard.
+ * entries are reference counted: FindObejct hands out a reference which the
+ * caller must drop with ReleaseObject, so an entry evicted while a client is
+ * still being served is freed by whoever drops the last reference.
+ *
+ * entries are stored with their freshness and validators. a fresh entry is
+ * served as is, a stale one stays around as the base of a conditional request
+ * to the origin until it is replaced or evicted.
+ *
+ * textual bodies are stored gzipped (see gzip.h): object then holds the
+ * response as sent to clients that accept gzip, with Content-Encoding and
+ * Content-Length rewritten, and identity_head the header as received. clients
+ * that do not accept gzip get identity_head and the body decompressed on the
+ * fly, see CacheIdentity.
+ *
+ * evicted objects are handed to the disk tier (see disk.h), which is looked up
+ * once the memory tier misses.
+ *
+ * the whole memory tier can be written to a snapshot file and loaded back
+ * from it, so a restarted proxy does not start cold. a snapshot is a header
+ * followed by one record per entry, least recently used first within each
+ * shard so loading it rebuilds the LRU order.
  */
 
-#define ENTRY_SIZE 10
+#define SHARD_BUCKETS 1024  // must be a power of 2
+#define DEFAULT_SHARDS 8
+/* every shard must be able to hold at least one max-sized object */
+#define MAX_SHARDS (MAX_CACHE_SIZE / MAX_OBJECT_SIZE)
+#define DEFAULT_POLICY "lru"
+
+/* what the cache knows about an object besides its bytes */
+typedef struct {
+    int framed;      // response ends by itself, not by closing the connection
+    time_t expires;  // stale from then on
+    char etag[MAX_VALIDATOR];           // "" if none
+    char last_modified[MAX_VALIDATOR];  // "" if none
+} CacheMeta;
+
+#define SNAPSHOT_MAGIC "PXYCACHE"
+#define SNAPSHOT_VERSION 1
 
 typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;  // records that follow
+} SnapshotHeader;
+
+/* followed by url, etag, last_modified and object, padded to 8 bytes */
+typedef struct {
+    uint32_t url_len;
+    uint32_t object_len;
+    uint16_t etag_len;
+    uint16_t last_modified_len;
+    int32_t framed;
+    int64_t expires;
+} SnapshotRecord;
+
+typedef struct Entry {
     char *url;  // url represent a string, including '\0'
-    char *object;
-    size_t object_len;
+    Chain object;
+    int compressed;       // object's body was gzipped by the cache
+    Chain identity_head;  // if compressed, header of the response as received
+    size_t body_off;      // if compressed, where the gzipped body starts in object
+    size_t footprint;     // memory held by object and identity_head, see EntrySize
+    CacheMeta meta;
+    unsigned long hash;
+    struct Entry *hnext;  // next entry in the same bucket
+    struct Entry *prev;   // LRU list
+    struct Entry *next;
+    int refcnt;  // one held by the cache itself, one per FindObejct caller
+    double priority;      // GDSF, lowest is evicted first
+    unsigned frequency;   // GDSF, hits since cached
+    size_t heap_index;    // GDSF, position in the shard's heap
 } Entry;
 
+typedef struct {
+    Entry *buckets[SHARD_BUCKETS];
+    Entry *lru_head;  // most recently used
+    Entry *lru_tail;  // least recently used, evicted first
+    size_t size;      // sum of EntrySize of all entries
+    size_t capacity;
+    Entry **heap;     // GDSF, min-heap on priority
+    size_t heap_len;
+    size_t heap_cap;
+    double clock;     // GDSF, priority of the last evicted entry
+    pthread_rwlock_t lock;  // guards everything above
+    pthread_mutex_t lru_mutex;  // lets readers reorder LRU list and policy under read lock
+    Sketch sketch;  // lookups per url hash, updated without the lock
+} Shard;
 
-void CacheInit();
+/* eviction order of a shard, every hook is called with the shard locked */
+typedef struct {
+    const char *name;
+    void (*insert)(Shard *shard, Entry *entry);  // entry was cached, may be NULL
+    void (*touch)(Shard *shard, Entry *entry);   // entry was hit, under lru_mutex, may be NULL
+    void (*remove)(Shard *shard, Entry *entry, int evicted);  // may be NULL
+    Entry *(*victim)(Shard *shard);              // entry to evict next, or NULL
+} EvictionPolicy;
 
-void CacheObject(char *url, size_t url_len, char *object, size_t object_len);
 
-char *FindObejct(char *url, size_t *object_len);
+/**
+ * @param nshards number of shards, clamped to [1, MAX_SHARDS]
+ * @param policy from CachePolicy
+ */
+void CacheInit(int nshards, const EvictionPolicy *policy);
+
+/**
+ * @return the eviction policy called name, or NULL if there is none
+ */
+const EvictionPolicy *CachePolicy(char *name);
+
+/**
+ * @brief cache object under url, replacing what was cached there, unless
+ * the admission policy turns it down. the cache takes over object's chunks,
+ * object is left empty whether or not it was admitted
+ */
+void CacheObject(char *url, size_t url_len, Chain *object, const CacheMeta *meta);
+
+/**
+ * @return a referenced entry, or NULL if url is not cached.
+ * entry->object stays valid until ReleaseObject(entry)
+ */
+Entry *FindObejct(char *url);
+
+void ReleaseObject(Entry *entry);
+
+/**
+ * @return bytes held by all shards
+ */
+size_t CacheUsage(void);
+
+/**
+ * @brief fill in meta of a response that was just received
+ */
+void CacheMetaInit(CacheMeta *meta, const ResponseHead *head);
+
+int CacheFresh(const Entry *entry);
+
+/**
+ * @brief append the response as received to out, decompressing the body of a
+ * compressed entry
+ * @return 0, or -1 if the body could not be decompressed
+ */
+int CacheIdentity(Entry *entry, Chain *out);
+
+/**
+ * @brief what entry is charged against its shard's capacity: the chunks it
+ * holds, not its length, or small objects would take many times their share
+ */
+static inline size_t EntrySize(const Entry *entry)
+{
+    return entry->footprint;
+}
+
+/**
+ * @brief write every cached object to path, through a temporary file renamed
+ * over it so a reader never sees a partial snapshot. clients keep being
+ * served meanwhile. an object that can not be rebuilt is skipped
+ * @return objects written, or -1 on an I/O error
+ */
+int CacheSnapshot(char *path);
+
+/**
+ * @brief cache the objects of a snapshot written by CacheSnapshot
+ * @return objects loaded, or -1 if path is missing or not a snapshot
+ */
+int CacheRestore(char *path);
 
-#endif
\ No newline at end of file
+#endif
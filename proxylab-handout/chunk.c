@@ -0,0 +1,192 @@
+#include "csapp.h"
+#include "chunk.h"
+
+static Chunk *g_free;  // shared free list
+static pthread_mutex_t g_free_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread Chunk *t_free;  // this thread's free list
+static __thread int t_nfree;
+
+static Chunk *ChunkAlloc();
+static void ChunkRelease(Chunk *chunk);
+
+void ChainInit(Chain *chain)
+{
+    chain->head = NULL;
+    chain->tail = NULL;
+    chain->len = 0;
+}
+
+void ChainFree(Chain *chain)
+{
+    Chunk *chunk = chain->head;
+    while (chunk != NULL) {
+        Chunk *next = chunk->next;
+        ChunkRelease(chunk);
+        chunk = next;
+    }
+    ChainInit(chain);
+}
+
+void ChainMove(Chain *dst, Chain *src)
+{
+    *dst = *src;
+    ChainInit(src);
+}
+
+void ChainAppend(Chain *chain, const char *data, size_t n)
+{
+    while (n > 0) {
+        size_t space;
+        char *tail = ChainReserve(chain, &space);
+        size_t cnt = n < space ? n : space;
+        memcpy(tail, data, cnt);
+        ChainCommit(chain, cnt);
+        data += cnt;
+        n -= cnt;
+    }
+}
+
+char *ChainReserve(Chain *chain, size_t *space)
+{
+    if (chain->tail == NULL || chain->tail->len == CHUNK_SIZE) {
+        Chunk *chunk = ChunkAlloc();
+        if (chain->tail != NULL) {
+            chain->tail->next = chunk;
+        } else {
+            chain->head = chunk;
+        }
+        chain->tail = chunk;
+    }
+
+    *space = CHUNK_SIZE - chain->tail->len;
+    return chain->tail->data + chain->tail->len;
+}
+
+void ChainCommit(Chain *chain, size_t n)
+{
+    chain->tail->len += n;
+    chain->len += n;
+}
+
+size_t ChainDropFront(Chain *chain, size_t n)
+{
+    size_t dropped = 0;
+    while (chain->head != NULL && chain->head->len <= n - dropped) {
+        Chunk *chunk = chain->head;
+        chain->head = chunk->next;
+        dropped += chunk->len;
+        ChunkRelease(chunk);
+    }
+    if (chain->head == NULL) {
+        chain->tail = NULL;
+    }
+    chain->len -= dropped;
+    return dropped;
+}
+
+size_t ChainFootprint(const Chain *chain)
+{
+    size_t nchunks = 0;
+    for (Chunk *chunk = chain->head; chunk != NULL; chunk = chunk->next) {
+        nchunks++;
+    }
+    return nchunks * CHUNK_SIZE;
+}
+
+int ChainIovec(Chain *chain, size_t off, struct iovec *iov)
+{
+    int iovcnt = 0;
+
+    Chunk *chunk = chain->head;
+    for (; chunk != NULL && off >= chunk->len; chunk = chunk->next) {
+        off -= chunk->len;
+    }
+    for (; chunk != NULL && iovcnt < CHAIN_IOV_MAX; chunk = chunk->next) {
+        iov[iovcnt].iov_base = chunk->data + off;
+        iov[iovcnt].iov_len = chunk->len - off;
+        iovcnt++;
+        off = 0;
+    }
+    return iovcnt;
+}
+
+ssize_t ChainWritev(int fd, Chain *chain, size_t off)
+{
+    struct iovec iov[CHAIN_IOV_MAX];
+    int iovcnt = ChainIovec(chain, off, iov);
+
+    if (iovcnt == 0) {
+        return 0;
+    }
+    return writev(fd, iov, iovcnt);
+}
+
+ssize_t ChainWriten(int fd, Chain *chain)
+{
+    size_t off = 0;
+    while (off < chain->len) {
+        ssize_t n = ChainWritev(fd, chain, off);
+        if (n <= 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        off += n;
+    }
+    return chain->len;
+}
+
+static Chunk *ChunkAlloc()
+{
+    if (t_free == NULL) {
+        /* refill from the shared list, or carve a new slab */
+        pthread_mutex_lock(&g_free_mutex);
+        while (g_free != NULL && t_nfree < LOCAL_FREE_MAX / 2) {
+            Chunk *chunk = g_free;
+            g_free = chunk->next;
+            chunk->next = t_free;
+            t_free = chunk;
+            t_nfree++;
+        }
+        pthread_mutex_unlock(&g_free_mutex);
+
+        if (t_free == NULL) {
+            Chunk *slab = (Chunk *)Malloc(SLAB_CHUNKS * sizeof(Chunk));
+            for (int i = 0; i < SLAB_CHUNKS; i++) {
+                slab[i].next = t_free;
+                t_free = &slab[i];
+            }
+            t_nfree = SLAB_CHUNKS;
+        }
+    }
+
+    Chunk *chunk = t_free;
+    t_free = chunk->next;
+    t_nfree--;
+
+    chunk->next = NULL;
+    chunk->len = 0;
+    return chunk;
+}
+
+static void ChunkRelease(Chunk *chunk)
+{
+    chunk->next = t_free;
+    t_free = chunk;
+    t_nfree++;
+
+    if (t_nfree > LOCAL_FREE_MAX) {
+        /* chunks freed by one thread (e.g. on eviction) go back to all */
+        pthread_mutex_lock(&g_free_mutex);
+        while (t_nfree > LOCAL_FREE_MAX / 2) {
+            Chunk *c = t_free;
+            t_free = c->next;
+            c->next = g_free;
+            g_free = c;
+            t_nfree--;
+        }
+        pthread_mutex_unlock(&g_free_mutex);
+    }
+}
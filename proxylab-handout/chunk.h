@@ -0,0 +1,89 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * response bodies are held in chains of fixed-size chunks, so a buffer grows
+ * one chunk at a time as bytes arrive instead of being sized for the largest
+ * object up front, and a finished chain can be handed over to the cache
+ * without copying. chunks come from slabs and are recycled through a
+ * per-thread free list backed by a shared one, they are never returned to
+ * malloc.
+ */
+
+#define CHUNK_SIZE 4096       // payload bytes per chunk
+#define SLAB_CHUNKS 16        // chunks carved from one Malloc
+#define LOCAL_FREE_MAX 64     // chunks a thread keeps before giving some back
+#define CHAIN_IOV_MAX 64      // iovecs per ChainWritev
+
+typedef struct Chunk {
+    struct Chunk *next;
+    size_t len;
+    char data[CHUNK_SIZE];
+} Chunk;
+
+typedef struct {
+    Chunk *head;
+    Chunk *tail;
+    size_t len;  // total bytes in all chunks
+} Chain;
+
+void ChainInit(Chain *chain);
+
+/**
+ * @brief return all chunks of chain to the free list, chain becomes empty
+ */
+void ChainFree(Chain *chain);
+
+/**
+ * @brief take over src's chunks, src becomes empty
+ */
+void ChainMove(Chain *dst, Chain *src);
+
+void ChainAppend(Chain *chain, const char *data, size_t n);
+
+/**
+ * @brief free space at the end of chain, adding a chunk if the last one is full.
+ * bytes written there become part of chain after ChainCommit
+ * @param space[out] number of bytes available at the returned pointer
+ */
+char *ChainReserve(Chain *chain, size_t *space);
+
+void ChainCommit(Chain *chain, size_t n);
+
+/**
+ * @brief free the whole chunks at the front of chain that lie within its
+ * first n bytes, no space may be reserved
+ * @return bytes dropped, at most n
+ */
+size_t ChainDropFront(Chain *chain, size_t n);
+
+/**
+ * @return payload bytes of the chunks chain holds, whole chunks however
+ * little of each is used
+ */
+size_t ChainFootprint(const Chain *chain);
+
+/**
+ * @brief describe the bytes of chain from offset off on, at most CHAIN_IOV_MAX
+ * chunks of them
+ * @return number of iovecs filled in
+ */
+int ChainIovec(Chain *chain, size_t off, struct iovec *iov);
+
+/**
+ * @brief one writev of the bytes of chain from offset off on
+ * @return as writev(2)
+ */
+ssize_t ChainWritev(int fd, Chain *chain, size_t off);
+
+/**
+ * @brief write whole chain like rio_writen
+ * @return chain->len, or -1 on error
+ */
+ssize_t ChainWriten(int fd, Chain *chain);
+
+#endif
@@ -0,0 +1,520 @@
+#include <sys/sendfile.h>
+#include "csapp.h"
+#include "disk.h"
+#include "stats.h"
+
+static char *g_dir;  // NULL while the tier is disabled
+static size_t g_capacity;      // bytes
+static size_t g_segment_size;
+static DiskSegment **g_segments;  // oldest first, the last one is appended to
+static int g_nsegments;
+static int g_max_segments;
+static unsigned g_next_id;
+static DiskEntry **g_buckets;
+static size_t g_nbuckets;  // a power of 2
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;  // guards all of the above
+static pthread_cond_t g_work = PTHREAD_COND_INITIALIZER;     // compactor may have work
+
+static void LoadSegments(void);
+static int CompareIds(const void *a, const void *b);
+static void IndexSegment(DiskSegment *segment);
+static void Index(DiskSegment *segment, size_t offset, unsigned long hash);
+static unsigned long HashUrl(const char *url, size_t url_len);
+static inline size_t RecordSize(size_t url_len, size_t object_len);
+static inline DiskRecord *RecordOf(DiskEntry *entry);
+static DiskEntry **FindLink(const char *url, size_t url_len, unsigned long hash);
+static void Unindex(DiskEntry **link);
+static DiskSegment *Reserve(size_t size, size_t *offset);
+static DiskSegment *NewSegment(void);
+static DiskSegment *MapSegment(unsigned id, int create);
+static void PutSegment(DiskSegment *segment);
+static void *Compactor(void *vargp);
+static DiskSegment *PickVictim(int *drop);
+static void Compact(DiskSegment *victim, int drop);
+static void Relocate(DiskEntry *entry, DiskRecord *record, size_t size);
+static void Retire(DiskSegment *victim);
+
+void DiskInit(char *dir, size_t capacity)
+{
+    if (dir == NULL) {
+        return;
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "can not create disk cache %s: %s\n", dir, strerror(errno));
+        return;
+    }
+    g_dir = strdup(dir);
+    g_capacity = capacity << 20;
+
+    /* small enough for the compactor to work in steps, big enough for any record */
+    size_t segment_size = g_capacity / DISK_MIN_SEGMENTS;
+    if (segment_size > DISK_SEGMENT_SIZE) {
+        segment_size = DISK_SEGMENT_SIZE;
+    }
+    if (segment_size < 2 * MAX_OBJECT_SIZE) {
+        segment_size = 2 * MAX_OBJECT_SIZE;
+    }
+    g_segment_size = (segment_size + 4095) & ~(size_t)4095;
+
+    /* the log head and one segment being compacted may go over capacity */
+    g_max_segments = g_capacity / g_segment_size + 2;
+    g_segments = (DiskSegment **)Calloc(g_max_segments, sizeof(DiskSegment *));
+
+    g_nbuckets = 1;
+    while (g_nbuckets < g_capacity / DISK_BUCKETS_PER) {
+        g_nbuckets <<= 1;
+    }
+    g_buckets = (DiskEntry **)Calloc(g_nbuckets, sizeof(DiskEntry *));
+    LoadSegments();
+
+    pthread_t tid;
+    Pthread_create(&tid, NULL, Compactor, NULL);
+}
+
+void DiskStore(char *url, size_t url_len, Chain *object, const CacheMeta *meta)
+{
+    if (g_dir == NULL || time(NULL) >= meta->expires) {
+        return;
+    }
+
+    size_t size = RecordSize(url_len, object->len);
+    size_t offset;
+    pthread_mutex_lock(&g_mutex);
+    DiskSegment *segment = Reserve(size, &offset);
+    DiskRecord *record = segment != NULL ? (DiskRecord *)(segment->base + offset) : NULL;
+    if (record != NULL) {
+        /*
+         * sizes go in before any later record is reserved, so after a crash
+         * IndexSegment steps over this one even if it never got filled in
+         */
+        record->url_len = url_len;
+        record->object_len = object->len;
+    }
+    pthread_mutex_unlock(&g_mutex);
+    if (segment == NULL) {
+        return;
+    }
+
+    /* reserved space is ours alone, fill it in without the lock */
+    record->framed = meta->framed;
+    record->expires = meta->expires;
+    char *p = (char *)(record + 1);
+    memcpy(p, url, url_len);
+    p += url_len;
+    for (Chunk *chunk = object->head; chunk != NULL; chunk = chunk->next) {
+        memcpy(p, chunk->data, chunk->len);
+        p += chunk->len;
+    }
+    /* set last, a record without it was cut short and is skipped by IndexSegment */
+    __atomic_store_n(&record->magic, DISK_RECORD_MAGIC, __ATOMIC_RELEASE);
+    StatsAdd(STAT_DISK_STORES, 1);
+
+    unsigned long hash = HashUrl(url, url_len);
+    pthread_mutex_lock(&g_mutex);
+    Index(segment, offset, hash);
+
+    /* a segment sealed while being filled in can be compacted from now on */
+    if (--segment->pending == 0 && segment != g_segments[g_nsegments - 1]) {
+        pthread_cond_signal(&g_work);
+    }
+    pthread_mutex_unlock(&g_mutex);
+}
+
+int DiskFind(char *url, DiskRef *ref)
+{
+    if (g_dir == NULL) {
+        return 0;
+    }
+
+    size_t url_len = strlen(url);
+    unsigned long hash = HashUrl(url, url_len);
+    pthread_mutex_lock(&g_mutex);
+    DiskEntry **link = FindLink(url, url_len, hash);
+    DiskEntry *entry = *link;
+    if (entry == NULL) {
+        pthread_mutex_unlock(&g_mutex);
+        return 0;
+    }
+    if (time(NULL) >= entry->expires) {
+        Unindex(link);
+        pthread_mutex_unlock(&g_mutex);
+        return 0;
+    }
+
+    DiskRecord *record = RecordOf(entry);
+    ref->segment = entry->segment;
+    ref->offset = entry->offset + sizeof(DiskRecord) + url_len;
+    ref->len = record->object_len;
+    ref->framed = record->framed;
+    entry->segment->refcnt++;
+    pthread_mutex_unlock(&g_mutex);
+    return 1;
+}
+
+ssize_t DiskSendfile(const DiskRef *ref, int connfd, size_t off)
+{
+    off_t offset = ref->offset + off;
+    return sendfile(connfd, ref->segment->fd, &offset, ref->len - off);
+}
+
+void DiskRelease(DiskRef *ref)
+{
+    pthread_mutex_lock(&g_mutex);
+    PutSegment(ref->segment);
+    pthread_mutex_unlock(&g_mutex);
+    ref->segment = NULL;
+}
+
+/**
+ * @brief the index is not persisted, rebuild it from the segments an earlier
+ * run left in g_dir. segments of another size are deleted, and so are the
+ * oldest ones beyond capacity
+ */
+static void LoadSegments(void)
+{
+    DIR *dp = opendir(g_dir);
+    if (dp == NULL) {
+        return;
+    }
+    unsigned *ids = NULL;
+    int nids = 0;
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        unsigned id;
+        if (sscanf(de->d_name, "seg-%u", &id) == 1) {
+            ids = (unsigned *)Realloc(ids, (nids + 1) * sizeof(unsigned));
+            ids[nids++] = id;
+        }
+    }
+    closedir(dp);
+    qsort(ids, nids, sizeof(unsigned), CompareIds);
+
+    char path[MAXLINE];
+    DiskSegment *segment;
+    for (int i = 0; i < nids; i++) {
+        /* keep one slot free for a new log head */
+        if (i >= nids - (g_max_segments - 1) && (segment = MapSegment(ids[i], 0)) != NULL) {
+            IndexSegment(segment);
+            g_next_id = ids[i] + 1;
+        } else {
+            snprintf(path, MAXLINE, "%s/seg-%08u", g_dir, ids[i]);
+            unlink(path);
+        }
+    }
+    Free(ids);
+}
+
+static int CompareIds(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *)a;
+    unsigned y = *(const unsigned *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief index the fresh records of a segment read back from disk, newer
+ * records of a url replace older ones as segments are indexed oldest first.
+ * a record reserved but never filled in has its sizes but not its magic
+ */
+static void IndexSegment(DiskSegment *segment)
+{
+    time_t now = time(NULL);
+    size_t offset = 0;
+    while (offset + sizeof(DiskRecord) <= g_segment_size) {
+        DiskRecord *record = (DiskRecord *)(segment->base + offset);
+        size_t size = RecordSize(record->url_len, record->object_len);
+        if (record->url_len == 0 || offset + size > g_segment_size) {
+            break;  // end of what was reserved
+        }
+        if (record->magic == DISK_RECORD_MAGIC && now < record->expires) {
+            Index(segment, offset, HashUrl((char *)(record + 1), record->url_len));
+        }
+        offset += size;
+    }
+    segment->used = offset;
+}
+
+/**
+ * @brief point the index entry of the record at offset in segment to it,
+ * replacing what was indexed for its url. caller must hold g_mutex
+ */
+static void Index(DiskSegment *segment, size_t offset, unsigned long hash)
+{
+    DiskRecord *record = (DiskRecord *)(segment->base + offset);
+    DiskEntry **link = FindLink((char *)(record + 1), record->url_len, hash);
+    if (*link != NULL) {
+        Unindex(link);
+    }
+    DiskEntry *entry = (DiskEntry *)Malloc(sizeof(DiskEntry));
+    entry->hash = hash;
+    entry->segment = segment;
+    entry->offset = offset;
+    entry->expires = record->expires;
+    entry->next = *link;
+    *link = entry;
+    segment->live += RecordSize(record->url_len, record->object_len);
+}
+
+/**
+ * FNV-1a
+ */
+static unsigned long HashUrl(const char *url, size_t url_len)
+{
+    unsigned long hash = 14695981039346656037UL;
+    for (size_t i = 0; i < url_len; i++) {
+        hash ^= (unsigned char)url[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/**
+ * @brief records are 8 byte aligned so their headers can be read in place
+ */
+static inline size_t RecordSize(size_t url_len, size_t object_len)
+{
+    return (sizeof(DiskRecord) + url_len + object_len + 7) & ~(size_t)7;
+}
+
+static inline DiskRecord *RecordOf(DiskEntry *entry)
+{
+    return (DiskRecord *)(entry->segment->base + entry->offset);
+}
+
+/**
+ * @return link to the entry of url in its bucket, or to the NULL ending the
+ * bucket. caller must hold g_mutex
+ */
+static DiskEntry **FindLink(const char *url, size_t url_len, unsigned long hash)
+{
+    DiskEntry **link = &g_buckets[hash & (g_nbuckets - 1)];
+    for (; *link != NULL; link = &(*link)->next) {
+        DiskRecord *record = RecordOf(*link);
+        if ((*link)->hash == hash && record->url_len == url_len &&
+            memcmp(record + 1, url, url_len) == 0) {
+            break;
+        }
+    }
+    return link;
+}
+
+/**
+ * @brief drop the entry at link, its record becomes garbage. caller must
+ * hold g_mutex
+ */
+static void Unindex(DiskEntry **link)
+{
+    DiskEntry *entry = *link;
+    DiskRecord *record = RecordOf(entry);
+    entry->segment->live -= RecordSize(record->url_len, record->object_len);
+    *link = entry->next;
+    Free(entry);
+}
+
+/**
+ * @brief reserve size bytes at the log head, starting a new segment when the
+ * head is full. caller must hold g_mutex, set the sizes of the record before
+ * letting go of it, and decrement pending once the record is filled in
+ * @return segment holding the space at *offset, or NULL
+ */
+static DiskSegment *Reserve(size_t size, size_t *offset)
+{
+    DiskSegment *head = g_nsegments > 0 ? g_segments[g_nsegments - 1] : NULL;
+    if (head == NULL || head->used + size > g_segment_size) {
+        if ((head = NewSegment()) == NULL) {
+            return NULL;
+        }
+    }
+    *offset = head->used;
+    head->used += size;
+    head->pending++;
+    return head;
+}
+
+/**
+ * @brief start a new log head. caller must hold g_mutex
+ */
+static DiskSegment *NewSegment(void)
+{
+    if (g_nsegments == g_max_segments) {
+        return NULL;  // compactor is behind, objects are not kept meanwhile
+    }
+
+    DiskSegment *segment = MapSegment(g_next_id++, 1);
+
+    /* the previous head is sealed now, it may be worth compacting */
+    if (segment != NULL && g_nsegments > 1) {
+        pthread_cond_signal(&g_work);
+    }
+    return segment;
+}
+
+/**
+ * @brief map segment id and list it as the newest one
+ * @param create 1 to create an empty segment, 0 to open an existing one of
+ * the current segment size
+ */
+static DiskSegment *MapSegment(unsigned id, int create)
+{
+    char path[MAXLINE];
+    snprintf(path, MAXLINE, "%s/seg-%08u", g_dir, id);
+    int fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0600);
+    if (fd < 0) {
+        fprintf(stderr, "can not open segment %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (create ? ftruncate(fd, g_segment_size) < 0 :
+                 fstat(fd, &st) < 0 || st.st_size != (off_t)g_segment_size) {
+        close(fd);
+        return NULL;
+    }
+    char *base = mmap(NULL, g_segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "can not map segment %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    DiskSegment *segment = (DiskSegment *)Calloc(1, sizeof(DiskSegment));
+    segment->id = id;
+    segment->fd = fd;
+    segment->base = base;
+    segment->refcnt = 1;
+    g_segments[g_nsegments++] = segment;
+    return segment;
+}
+
+/**
+ * @brief drop a reference to segment, the last one unmaps and closes it.
+ * caller must hold g_mutex
+ */
+static void PutSegment(DiskSegment *segment)
+{
+    if (--segment->refcnt != 0) {
+        return;
+    }
+    Munmap(segment->base, g_segment_size);
+    close(segment->fd);
+    Free(segment);
+}
+
+/**
+ * @brief drop the oldest segment while over capacity, otherwise compact
+ * segments that are mostly garbage. runs with g_mutex held except in
+ * between records
+ */
+static void *Compactor(void *vargp)
+{
+    Pthread_detach(pthread_self());
+
+    pthread_mutex_lock(&g_mutex);
+    while (1) {
+        int drop;
+        DiskSegment *victim;
+        while ((victim = PickVictim(&drop)) == NULL) {
+            pthread_cond_wait(&g_work, &g_mutex);
+        }
+        Compact(victim, drop);
+        Retire(victim);
+    }
+
+    return NULL;
+}
+
+/**
+ * @param drop[out] 1 if the victim's records are to be dropped rather than
+ * moved to the log head
+ * @return sealed segment to get rid of, or NULL. caller must hold g_mutex
+ */
+static DiskSegment *PickVictim(int *drop)
+{
+    /* the log head is never a victim, it is still appended to */
+    if (g_nsegments < 2) {
+        return NULL;
+    }
+    if ((size_t)g_nsegments * g_segment_size > g_capacity) {
+        *drop = 1;
+        return g_segments[0]->pending == 0 ? g_segments[0] : NULL;
+    }
+
+    *drop = 0;
+    for (int i = 0; i < g_nsegments - 1; i++) {
+        DiskSegment *segment = g_segments[i];
+        if (segment->pending == 0 && segment->live * DISK_COMPACT_LIVE < segment->used) {
+            return segment;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief unindex every live record of victim, moving fresh ones to the log
+ * head unless drop is set. caller must hold g_mutex
+ */
+static void Compact(DiskSegment *victim, int drop)
+{
+    size_t offset = 0;
+    while (offset < victim->used) {
+        DiskRecord *record = (DiskRecord *)(victim->base + offset);
+        size_t size = RecordSize(record->url_len, record->object_len);
+        char *url = (char *)(record + 1);
+
+        /* the record is live if url's entry still points to it */
+        DiskEntry **link = FindLink(url, record->url_len, HashUrl(url, record->url_len));
+        DiskEntry *entry = *link;
+        if (entry != NULL && entry->segment == victim && entry->offset == offset) {
+            if (drop || time(NULL) >= entry->expires) {
+                Unindex(link);
+            } else {
+                Relocate(entry, record, size);
+            }
+        }
+        offset += size;
+
+        /* let lookups and stores in between records */
+        pthread_mutex_unlock(&g_mutex);
+        pthread_mutex_lock(&g_mutex);
+    }
+}
+
+/**
+ * @brief copy record to the log head and point entry to the copy. caller
+ * must hold g_mutex
+ */
+static void Relocate(DiskEntry *entry, DiskRecord *record, size_t size)
+{
+    size_t offset;
+    DiskSegment *head = Reserve(size, &offset);
+    if (head == NULL) {
+        DiskEntry **link = FindLink((char *)(record + 1), record->url_len, entry->hash);
+        Unindex(link);
+        return;
+    }
+
+    memcpy(head->base + offset, record, size);
+    head->pending--;
+    entry->segment->live -= size;
+    head->live += size;
+    entry->segment = head;
+    entry->offset = offset;
+}
+
+/**
+ * @brief delete victim, nothing in the index points to it anymore. caller
+ * must hold g_mutex
+ */
+static void Retire(DiskSegment *victim)
+{
+    int i = 0;
+    while (g_segments[i] != victim) {
+        i++;
+    }
+    memmove(&g_segments[i], &g_segments[i + 1], (g_nsegments - i - 1) * sizeof(DiskSegment *));
+    g_nsegments--;
+
+    char path[MAXLINE];
+    snprintf(path, MAXLINE, "%s/seg-%08u", g_dir, victim->id);
+    unlink(path);
+    PutSegment(victim);
+}
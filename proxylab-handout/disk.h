@@ -0,0 +1,94 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "chunk.h"
+#include "cache.h"
+
+/**
+ * second cache tier on disk, below the in-memory cache. objects evicted from
+ * memory are appended to a log of segment files, each one mapped shared into
+ * memory, and an in-memory index maps the url hash of every object to its
+ * segment, offset and length. a hit is sent straight from the segment file
+ * with sendfile(2), the object is not copied into memory nor promoted back.
+ *
+ * only the newest segment is appended to. replacing or expiring an object
+ * just leaves its old record behind as garbage; a compactor thread copies
+ * the live records of mostly-garbage segments to the log head and deletes
+ * them, and drops the oldest segment whole once the tier is over capacity.
+ * a segment in use by a DiskRef stays open until the reference is dropped.
+ *
+ * records describe themselves, so a restarted proxy rebuilds the index by
+ * scanning the segments it finds instead of starting with an empty tier.
+ */
+
+#define DISK_SEGMENT_SIZE (64 << 20)  // largest segment
+#define DISK_MIN_SEGMENTS 8           // smaller tiers use smaller segments
+#define DISK_DEFAULT_CAPACITY 1024    // megabytes
+#define DISK_BUCKETS_PER 16384        // bytes of capacity per index bucket
+#define DISK_COMPACT_LIVE 2           // compact segments less than 1/2 live
+#define DISK_RECORD_MAGIC 0x4b534944  // "DISK"
+
+/* header of a record, followed by the url and the object */
+typedef struct {
+    uint32_t magic;
+    uint32_t url_len;
+    uint32_t object_len;
+    int32_t framed;
+    int64_t expires;
+} DiskRecord;
+
+typedef struct DiskSegment {
+    unsigned id;    // names the file, older segments have smaller ids
+    int fd;
+    char *base;     // whole file, mapped shared
+    size_t used;    // bytes reserved for records so far
+    size_t live;    // bytes of records the index still points to
+    int pending;    // records reserved but still being copied in
+    int refcnt;     // one while listed in the tier, one per DiskRef
+} DiskSegment;
+
+typedef struct DiskEntry {
+    unsigned long hash;
+    DiskSegment *segment;
+    size_t offset;  // of the record in segment
+    time_t expires;
+    struct DiskEntry *next;  // next entry in the same bucket
+} DiskEntry;
+
+/* an object found on disk, pins its segment until DiskRelease */
+typedef struct {
+    DiskSegment *segment;
+    off_t offset;  // of the object in the segment file
+    size_t len;
+    int framed;
+} DiskRef;
+
+/**
+ * @param dir directory for the segment files, NULL leaves the tier disabled.
+ * segments left there by an earlier run are indexed again
+ * @param capacity megabytes of segments to keep at most
+ */
+void DiskInit(char *dir, size_t capacity);
+
+/**
+ * @brief append a copy of object to the log, replacing what was stored under
+ * url. expired objects are not stored
+ */
+void DiskStore(char *url, size_t url_len, Chain *object, const CacheMeta *meta);
+
+/**
+ * @return 1 and a reference to the fresh object stored under url in ref, or 0
+ */
+int DiskFind(char *url, DiskRef *ref);
+
+/**
+ * @brief one sendfile(2) of the object from byte off on
+ * @return as sendfile(2)
+ */
+ssize_t DiskSendfile(const DiskRef *ref, int connfd, size_t off);
+
+void DiskRelease(DiskRef *ref);
+
+#endif
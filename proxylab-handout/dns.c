@@ -0,0 +1,335 @@
+#include "csapp.h"
+#include "dns.h"
+
+/* name pinned to an address by the hosts file */
+typedef struct HostsEntry {
+    char *name;
+    char *address;
+    struct HostsEntry *next;
+} HostsEntry;
+
+static HostsEntry *g_hosts;  // read only once DnsInit returns
+
+static DnsEntry *g_entries[DNS_BUCKETS];
+static int g_nentries;
+static time_t g_last_sweep;
+static DnsEntry *g_queue;  // lookups waiting for a resolver, oldest first
+static DnsEntry *g_queue_tail;
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;  // guards all of the above
+static pthread_cond_t g_queued = PTHREAD_COND_INITIALIZER;    // g_queue became non-empty
+static pthread_cond_t g_resolved = PTHREAD_COND_INITIALIZER;  // some lookup finished
+
+static void LoadHosts(char *hosts_file);
+static int LookupHosts(char *host, char *port, DnsResult *result);
+static DnsStatus LookupLocked(char *host, char *port, DnsResult *result, int notify_fd);
+static DnsEntry *FindEntry(char *host, char *port);
+static unsigned long HashHost(char *host);
+static void Sweep(time_t now);
+static void *Resolver(void *vargp);
+static int Resolve(char *host, char *port, int flags, DnsResult *result);
+
+void DnsInit(char *hosts_file)
+{
+    if (hosts_file != NULL) {
+        LoadHosts(hosts_file);
+    }
+
+    pthread_t tid;
+    for (int i = 0; i < DNS_RESOLVERS; i++) {
+        Pthread_create(&tid, NULL, Resolver, NULL);
+    }
+}
+
+DnsStatus DnsLookup(char *host, char *port, DnsResult *result, int notify_fd)
+{
+    if (LookupHosts(host, port, result) == 0) {
+        return DNS_RESOLVED;
+    }
+
+    pthread_mutex_lock(&g_mutex);
+    DnsStatus status = LookupLocked(host, port, result, notify_fd);
+    pthread_mutex_unlock(&g_mutex);
+    return status;
+}
+
+DnsStatus DnsResolve(char *host, char *port, DnsResult *result, int timeout)
+{
+    if (LookupHosts(host, port, result) == 0) {
+        return DNS_RESOLVED;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+
+    DnsStatus status;
+    pthread_mutex_lock(&g_mutex);
+    while ((status = LookupLocked(host, port, result, -1)) == DNS_PENDING) {
+        if (timeout <= 0) {
+            pthread_cond_wait(&g_resolved, &g_mutex);
+        } else if (pthread_cond_timedwait(&g_resolved, &g_mutex, &deadline) == ETIMEDOUT) {
+            /* the lookup stays queued, a later request may find it done */
+            status = LookupLocked(host, port, result, -1);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_mutex);
+    return status;
+}
+
+int DnsConnect(const DnsResult *result, int *from, int nonblock)
+{
+    for (int i = *from; i < result->naddrs; i++) {
+        const DnsAddr *addr = &result->addrs[i];
+        int fd = socket(addr->family, addr->socktype | (nonblock ? SOCK_NONBLOCK : 0), addr->protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, (const struct sockaddr *)&addr->addr, addr->addrlen) == 0 ||
+            (nonblock && errno == EINPROGRESS)) {
+            *from = i;
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+/**
+ * @brief same format as /etc/hosts: an address followed by names, '#' starts
+ * a comment
+ */
+static void LoadHosts(char *hosts_file)
+{
+    FILE *fp = fopen(hosts_file, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "can not open hosts file %s: %s\n", hosts_file, strerror(errno));
+        return;
+    }
+
+    char line[MAXLINE];
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        char *save;
+        char *address = strtok_r(line, " \t\r\n", &save);
+        if (address == NULL) {
+            continue;
+        }
+        char *name;
+        while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            HostsEntry *hosts = (HostsEntry *)Malloc(sizeof(HostsEntry));
+            hosts->name = strdup(name);
+            hosts->address = strdup(address);
+            hosts->next = g_hosts;
+            g_hosts = hosts;
+        }
+    }
+    fclose(fp);
+}
+
+/**
+ * @return 0 if host is pinned by the hosts file, result is filled in then
+ */
+static int LookupHosts(char *host, char *port, DnsResult *result)
+{
+    for (HostsEntry *hosts = g_hosts; hosts != NULL; hosts = hosts->next) {
+        if (strcasecmp(hosts->name, host) == 0) {
+            return Resolve(hosts->address, port, AI_NUMERICHOST, result);
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief answer from the cache, queueing a lookup if the entry is missing or
+ * expired. caller must hold g_mutex
+ */
+static DnsStatus LookupLocked(char *host, char *port, DnsResult *result, int notify_fd)
+{
+    time_t now = time(NULL);
+    DnsEntry *entry = FindEntry(host, port);
+    if (entry == NULL) {
+        Sweep(now);
+        entry = (DnsEntry *)Calloc(1, sizeof(DnsEntry));
+        entry->host = strdup(host);
+        entry->port = strdup(port);
+
+        DnsEntry **bucket = &g_entries[HashHost(host) & (DNS_BUCKETS - 1)];
+        entry->next = *bucket;
+        *bucket = entry;
+        g_nentries++;
+    }
+
+    if (now >= entry->expires && !entry->resolving) {
+        entry->resolving = 1;
+        entry->qnext = NULL;
+        if (g_queue_tail != NULL) {
+            g_queue_tail->qnext = entry;
+        } else {
+            g_queue = entry;
+        }
+        g_queue_tail = entry;
+        pthread_cond_signal(&g_queued);
+    }
+
+    /* stale addresses are still served while the refresh is under way */
+    if (entry->expires != 0 && !entry->failed) {
+        *result = entry->result;
+        return DNS_RESOLVED;
+    }
+    if (!entry->resolving) {
+        return DNS_FAILED;
+    }
+
+    if (notify_fd >= 0) {
+        DnsNotify *notify;
+        for (notify = entry->notify; notify != NULL; notify = notify->next) {
+            if (notify->fd == notify_fd) {
+                break;
+            }
+        }
+        if (notify == NULL) {
+            notify = (DnsNotify *)Malloc(sizeof(DnsNotify));
+            notify->fd = notify_fd;
+            notify->next = entry->notify;
+            entry->notify = notify;
+        }
+    }
+    return DNS_PENDING;
+}
+
+/**
+ * @brief caller must hold g_mutex
+ */
+static DnsEntry *FindEntry(char *host, char *port)
+{
+    DnsEntry *entry = g_entries[HashHost(host) & (DNS_BUCKETS - 1)];
+    for (; entry != NULL; entry = entry->next) {
+        if (strcasecmp(entry->host, host) == 0 && strcmp(entry->port, port) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief djb2 over the lower-cased name, host names are case insensitive
+ */
+static unsigned long HashHost(char *host)
+{
+    unsigned long hash = 5381;
+    for (char *p = host; *p != '\0'; p++) {
+        hash = hash * 33 + (unsigned char)tolower((unsigned char)*p);
+    }
+    return hash;
+}
+
+/**
+ * @brief once the table is full, drop expired entries nobody is resolving,
+ * at most once a second. caller must hold g_mutex
+ */
+static void Sweep(time_t now)
+{
+    if (g_nentries < DNS_MAX_ENTRIES || now == g_last_sweep) {
+        return;
+    }
+    g_last_sweep = now;
+
+    for (int i = 0; i < DNS_BUCKETS; i++) {
+        DnsEntry **link = &g_entries[i];
+        while (*link != NULL) {
+            DnsEntry *entry = *link;
+            if (now >= entry->expires && !entry->resolving) {
+                *link = entry->next;
+                g_nentries--;
+                Free(entry->host);
+                Free(entry->port);
+                Free(entry);
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+/**
+ * @brief resolve queued entries one at a time, then wake whoever waits on them
+ */
+static void *Resolver(void *vargp)
+{
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        pthread_mutex_lock(&g_mutex);
+        while (g_queue == NULL) {
+            pthread_cond_wait(&g_queued, &g_mutex);
+        }
+        DnsEntry *entry = g_queue;
+        g_queue = entry->qnext;
+        if (g_queue == NULL) {
+            g_queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&g_mutex);
+
+        /* host and port never change, and Sweep leaves resolving entries alone */
+        DnsResult result;
+        int rc = Resolve(entry->host, entry->port, 0, &result);
+
+        pthread_mutex_lock(&g_mutex);
+        time_t now = time(NULL);
+        if (rc == 0) {
+            entry->result = result;
+            entry->failed = 0;
+            entry->expires = now + DNS_TTL;
+        } else {
+            /* a failed refresh keeps serving the stale addresses for a while */
+            entry->failed = entry->expires == 0 || entry->failed;
+            entry->expires = now + DNS_NEGATIVE_TTL;
+        }
+        entry->resolving = 0;
+
+        while (entry->notify != NULL) {
+            DnsNotify *notify = entry->notify;
+            entry->notify = notify->next;
+            if (write(notify->fd, "", 1) < 0 && errno != EAGAIN) {
+                fprintf(stderr, "dns notify error: %s\n", strerror(errno));
+            }
+            Free(notify);
+        }
+        pthread_cond_broadcast(&g_resolved);
+        pthread_mutex_unlock(&g_mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * @return 0 and up to DNS_MAX_ADDRS stream addresses of host:port in result,
+ * or -1
+ */
+static int Resolve(char *host, char *port, int flags, DnsResult *result)
+{
+    struct addrinfo hints, *listp, *p;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG | flags;
+    if (getaddrinfo(host, port, &hints, &listp) != 0) {
+        return -1;
+    }
+
+    result->naddrs = 0;
+    for (p = listp; p != NULL && result->naddrs < DNS_MAX_ADDRS; p = p->ai_next) {
+        DnsAddr *addr = &result->addrs[result->naddrs++];
+        addr->family = p->ai_family;
+        addr->socktype = p->ai_socktype;
+        addr->protocol = p->ai_protocol;
+        addr->addrlen = p->ai_addrlen;
+        memcpy(&addr->addr, p->ai_addr, p->ai_addrlen);
+    }
+    freeaddrinfo(listp);
+    return result->naddrs > 0 ? 0 : -1;
+}
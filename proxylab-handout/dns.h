@@ -0,0 +1,91 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <sys/socket.h>
+#include <time.h>
+
+/**
+ * in-process cache of name resolutions keyed by host:port. getaddrinfo is only
+ * ever called by a few resolver threads, never by a worker or a reactor: a
+ * fresh entry is answered from memory, an expired one is answered with its
+ * stale addresses while a resolver refreshes it in the background, and a
+ * failed lookup is remembered for DNS_NEGATIVE_TTL so a dead name is not
+ * resolved again on every request. names listed in the hosts file given to
+ * DnsInit are answered directly and never reach the resolvers.
+ */
+
+#define DNS_BUCKETS 256  // must be a power of 2
+#define DNS_MAX_ADDRS 4
+#define DNS_RESOLVERS 2
+#define DNS_MAX_ENTRIES 4096  // expired entries are swept beyond this
+#define DNS_TTL 60  // seconds, getaddrinfo does not report the record's TTL
+#define DNS_NEGATIVE_TTL 5
+
+typedef struct {
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+} DnsAddr;
+
+typedef struct {
+    int naddrs;
+    DnsAddr addrs[DNS_MAX_ADDRS];
+} DnsResult;
+
+typedef enum {
+    DNS_RESOLVED,
+    DNS_PENDING,  // a resolver is on it, ask again once notified
+    DNS_FAILED,
+} DnsStatus;
+
+/* descriptor to write a byte to once a pending lookup finishes */
+typedef struct DnsNotify {
+    int fd;
+    struct DnsNotify *next;
+} DnsNotify;
+
+typedef struct DnsEntry {
+    char *host;
+    char *port;
+    DnsResult result;
+    int failed;      // last lookup failed and nothing stale is left to serve
+    int resolving;   // queued for or being handled by a resolver
+    time_t expires;  // 0 until the first lookup finishes
+    DnsNotify *notify;
+    struct DnsEntry *next;   // next entry in the same bucket
+    struct DnsEntry *qnext;  // resolver queue
+} DnsEntry;
+
+/**
+ * @param hosts_file "address name..." lines answered without resolving,
+ * or NULL
+ */
+void DnsInit(char *hosts_file);
+
+/**
+ * @brief look host:port up without blocking
+ * @param notify_fd if >= 0 and the lookup is pending, a byte is written to it
+ * once the lookup finishes
+ */
+DnsStatus DnsLookup(char *host, char *port, DnsResult *result, int notify_fd);
+
+/**
+ * @brief look host:port up, waiting for a resolver if needed
+ * @param timeout seconds to wait for a resolver, 0 waits forever
+ * @return DNS_RESOLVED, DNS_FAILED if host:port can not be resolved, or
+ * DNS_PENDING if the timeout ran out first
+ */
+DnsStatus DnsResolve(char *host, char *port, DnsResult *result, int timeout);
+
+/**
+ * @param from[in,out] first address of result to try, set to the address the
+ * socket returned connects to
+ * @return socket connected to the first reachable address of result, or -1.
+ * with nonblock set the connect may still be in progress; if it then fails,
+ * call again with *from one past it to go on with the next address
+ */
+int DnsConnect(const DnsResult *result, int *from, int nonblock);
+
+#endif
@@ -0,0 +1,993 @@
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+#include "event.h"
+#include "relay.h"
+#include "dns.h"
+#include "disk.h"
+#include "upstream.h"
+#include "stats.h"
+#include "logger.h"
+
+typedef enum {
+    READING_REQUEST,  // reading request line and headers from client
+    RESOLVING,        // waiting for a resolver to look origin up
+    CONNECTING,       // waiting for non-blocking connect to origin
+    SENDING_REQUEST,  // writing the rewritten request to origin
+    RELAYING,         // copying origin response to client
+    SENDING_CACHED,   // writing a cached object to client
+    SENDING_DISK,     // sending an object from the disk tier to client
+    TUNNELING,        // relaying both ways for CONNECT
+} ConnState;
+
+typedef struct Conn Conn;
+
+/* stored in epoll_event.data.ptr, tells which side of a connection is ready */
+typedef struct {
+    Conn *conn;
+    int fd;
+    int added;          // fd is in the epoll set
+    unsigned events;    // currently registered interest
+} Endpoint;
+
+struct Conn {
+    ConnState state;
+    int closed;
+    Endpoint client;  // connection between client and proxy
+    Endpoint server;  // connection between proxy and origin
+    char buf[MAXBUF];  // request from client, then response chunks from origin
+    size_t buf_len;
+    size_t buf_off;    // bytes of buf already written to client
+    HttpParser parser; // request head, parsed in buf as it arrives
+    char *out;         // rewritten request to origin, or early tunnel bytes
+    size_t out_len;
+    size_t out_off;
+    char *url;         // request target, NULL until the head is parsed
+    RequestTrace trace;
+    ResponseHead head; // of the response being cached, once head_parsed
+    CacheMeta meta;
+    char *host;        // origin
+    char *port;
+    DnsResult addrs;   // of host:port, once resolved
+    int addr;          // index in addrs of the connect in progress
+    Chain cache;       // copy of response for the cache
+    int can_cache;
+    int authorized;    // request carries Authorization, see ResponseCacheable
+    int head_parsed;   // response header seen, meta is set
+    Entry *entry;      // cache hit being sent
+    Chain *sending;    // entry->object, or its identity form in cache
+    DiskRef disk;      // disk hit being sent, if disk.segment is set
+    size_t entry_off;  // bytes of either hit already sent
+    int pipefd[2];     // splice pipe once the response can not be cached
+    size_t piped;      // bytes waiting in the pipe
+    int reserved;      // counted against the cap of host:port
+    int tunnel;        // CONNECT, origin is host:port of the target
+    SpliceDir up;      // client to origin, once TUNNELING
+    SpliceDir down;    // origin to client, once TUNNELING
+    time_t deadline;   // the wait in progress times out then, 0 for never
+    time_t expires;    // end of g_timeouts.total for the response, 0 for never
+    Conn *next_free;
+    Conn *next_resolving;
+    Conn *prev_live;   // every open connection of the reactor, for ExpireConns
+    Conn *next_live;
+};
+
+/* every reactor thread runs its own loop over its own epoll set */
+static __thread int t_epfd;
+static __thread Conn *t_closed;  // freed once the current batch of events is handled
+static __thread Conn *t_resolving;  // waiting for DnsLookup to finish
+static __thread int t_dns_pipe[2];  // resolvers write here when a lookup finishes
+static __thread Endpoint t_dns_ep;  // marks t_dns_pipe[0] in epoll events
+static __thread Conn *t_live;  // open connections
+static __thread time_t t_swept;  // last ExpireConns
+
+static void *ReactorThread(void *vargp);
+
+static void AcceptClients(int listenfd);
+static void Watch(Endpoint *ep, unsigned events);
+static void ReadRequest(Conn *conn);
+static void StartRequest(Conn *conn);
+static void ResolveUpstream(Conn *conn);
+static void ResumeResolving(void);
+static void ConnectUpstream(Conn *conn);
+static void FinishConnect(Conn *conn);
+static void SendRequest(Conn *conn);
+static void Relay(Conn *conn);
+static void RelaySpliced(Conn *conn);
+static void StartTunnel(Conn *conn);
+static void OpenTunnel(Conn *conn);
+static void Tunnel(Conn *conn);
+static void StageForCache(Conn *conn, char *data, size_t n);
+static void CheckCacheable(Conn *conn);
+static int ResponseComplete(Conn *conn);
+static void SendCached(Conn *conn);
+static int RequestAcceptsGzip(const HttpParser *parser);
+static void SendDisk(Conn *conn);
+static void ErrorReply(Conn *conn, char *errnum, char *shortmsg);
+static void Sent(Conn *conn, size_t n);
+static inline void Arm(Conn *conn, int seconds);
+static void ExpireConns(void);
+static void CloseConn(Conn *conn);
+
+void RunReactors(char *port, int nreactors)
+{
+    /* every connection costs two descriptors, allow as many as the hard limit */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    pthread_t tid;
+    for (int i = 1; i < nreactors; i++) {
+        Pthread_create(&tid, NULL, ReactorThread, port);
+    }
+    ReactorThread(port);
+}
+
+static void *ReactorThread(void *vargp)
+{
+    int listenfd = Open_reuseport_listenfd((char *)vargp);
+    EventLoop(listenfd);
+    return NULL;
+}
+
+void EventLoop(int listenfd)
+{
+    if ((t_epfd = epoll_create1(0)) < 0) {
+        unix_error("epoll_create1 error");
+    }
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  // NULL marks the listening socket
+    if (epoll_ctl(t_epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+
+    if (pipe(t_dns_pipe) < 0) {
+        unix_error("pipe error");
+    }
+    fcntl(t_dns_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(t_dns_pipe[1], F_SETFL, O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &t_dns_ep;
+    if (epoll_ctl(t_epfd, EPOLL_CTL_ADD, t_dns_pipe[0], &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(t_epfd, events, MAX_EVENTS, SWEEP_INTERVAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unix_error("epoll_wait error");
+        }
+
+        for (int i = 0; i < n; i++) {
+            Endpoint *ep = events[i].data.ptr;
+            if (ep == NULL) {
+                AcceptClients(listenfd);
+                continue;
+            }
+            if (ep == &t_dns_ep) {
+                ResumeResolving();
+                continue;
+            }
+
+            Conn *conn = ep->conn;
+            if (conn->closed) {
+                continue;
+            }
+            switch (conn->state) {
+            case READING_REQUEST:
+                ReadRequest(conn);
+                break;
+            case RESOLVING:
+                /* client is not watched for input meanwhile, only errors show up */
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    CloseConn(conn);
+                }
+                break;
+            case CONNECTING:
+                FinishConnect(conn);
+                break;
+            case SENDING_REQUEST:
+                SendRequest(conn);
+                break;
+            case RELAYING:
+                Relay(conn);
+                break;
+            case SENDING_CACHED:
+                SendCached(conn);
+                break;
+            case SENDING_DISK:
+                SendDisk(conn);
+                break;
+            case TUNNELING:
+                /* a socket a tunnel no longer waits on still reports errors */
+                if (events[i].events & EPOLLERR) {
+                    CloseConn(conn);
+                } else {
+                    Tunnel(conn);
+                }
+                break;
+            }
+        }
+        if (time(NULL) != t_swept) {
+            ExpireConns();
+        }
+
+        while (t_closed != NULL) {
+            Conn *conn = t_closed;
+            t_closed = conn->next_free;
+            Free(conn);
+        }
+    }
+}
+
+static void AcceptClients(int listenfd)
+{
+    while (1) {
+        int connfd = accept(listenfd, NULL, NULL);
+        if (connfd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "accept error: %s\n", strerror(errno));
+            }
+            return;
+        }
+        fcntl(connfd, F_SETFL, O_NONBLOCK);
+        StatsAdd(STAT_CONNECTIONS, 1);
+
+        Conn *conn = (Conn *)Calloc(1, sizeof(Conn));
+        TraceStart(&conn->trace, StatsNow());
+        conn->state = READING_REQUEST;
+        conn->client.conn = conn;
+        conn->client.fd = connfd;
+        conn->server.conn = conn;
+        conn->server.fd = -1;
+        conn->pipefd[0] = conn->pipefd[1] = -1;
+        HttpParserInit(&conn->parser, 0);
+        conn->next_live = t_live;
+        if (t_live != NULL) {
+            t_live->prev_live = conn;
+        }
+        t_live = conn;
+        Arm(conn, g_timeouts.read);
+        Watch(&conn->client, EPOLLIN);
+    }
+}
+
+/**
+ * @brief set the events epoll reports for ep, 0 keeps fd registered but quiet
+ */
+static void Watch(Endpoint *ep, unsigned events)
+{
+    if (ep->added && ep->events == events) {
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(t_epfd, ep->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, ep->fd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+    ep->added = 1;
+    ep->events = events;
+}
+
+static void ReadRequest(Conn *conn)
+{
+    ssize_t n = read(conn->client.fd, conn->buf + conn->buf_len, MAXBUF - conn->buf_len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        CloseConn(conn);
+        return;
+    }
+
+    /* only the bytes just read are parsed, the head so far is not looked at again */
+    conn->buf_len += n;
+    Arm(conn, g_timeouts.read);
+    int rc = HttpParse(&conn->parser, conn->buf, conn->buf_len);
+    if (rc == HTTP_DONE) {
+        TraceMark(&conn->trace, TIME_PARSED);
+        StartRequest(conn);
+    } else if (rc == HTTP_ERROR || conn->buf_len == MAXBUF) {
+        TraceMark(&conn->trace, TIME_PARSED);
+        ErrorReply(conn, "400", "Bad Request");
+    }
+}
+
+/**
+ * @brief whole request header is in conn->buf, serve it from cache or
+ * start connecting to origin
+ */
+static void StartRequest(Conn *conn)
+{
+    HttpParser *parser = &conn->parser;
+    char url[MAXLINE];
+    SliceCopy(parser->target, url, MAXLINE);
+    conn->url = strdup(url);
+
+    if (SliceCaseEqual(parser->method, "CONNECT")) {
+        StartTunnel(conn);
+        return;
+    }
+    if (!SliceCaseEqual(parser->method, "GET")) {
+        ErrorReply(conn, "501", "Not Implemented");
+        return;
+    }
+    if (strcmp(url, STATS_PATH) == 0) {
+        TraceOutcome(&conn->trace, STAT_ADMIN);
+        StatsResponse(conn->client.fd, &conn->cache);
+        conn->sending = &conn->cache;
+        conn->state = SENDING_CACHED;
+        SendCached(conn);
+        return;
+    }
+    if (strncmp(url, "http://", 7) != 0) {
+        ErrorReply(conn, "400", "Bad Request");
+        return;
+    }
+
+    /* stale entries are fetched again, only the threaded engine revalidates */
+    Entry *entry;
+    if ((entry = FindObejct(url)) != NULL && !CacheFresh(entry)) {
+        ReleaseObject(entry);
+        entry = NULL;
+    }
+    int on_disk = entry == NULL && DiskFind(url, &conn->disk);
+    TraceMark(&conn->trace, TIME_LOOKED_UP);
+    if (entry != NULL) {
+        TraceOutcome(&conn->trace, STAT_HITS);
+        conn->entry = entry;
+        conn->sending = &entry->object;
+        if (entry->compressed && !RequestAcceptsGzip(parser)) {
+            if (CacheIdentity(entry, &conn->cache) < 0) {
+                CloseConn(conn);
+                return;
+            }
+            conn->sending = &conn->cache;
+        }
+        conn->state = SENDING_CACHED;
+        SendCached(conn);
+        return;
+    }
+    if (on_disk) {
+        TraceOutcome(&conn->trace, STAT_DISK_HITS);
+        conn->state = SENDING_DISK;
+        SendDisk(conn);
+        return;
+    }
+
+    char hostname[MAXLINE];
+    char path[MAXLINE];
+    ParseHostnamePath(url, MAXLINE, hostname, path, MAXLINE);
+
+    char port[MAXLINE];
+    if (ExtractPort(hostname, MAXLINE, port, MAXLINE) == 0) {
+        strcpy(port, "80");
+    }
+
+    /* rewrite request line and headers the same way ProxyRequestServer does */
+    char *out = (char *)Malloc(conn->buf_len + strlen(path) + strlen(hostname) + strlen(user_agent_hdr) + 128);
+    int len = sprintf(out, "GET %s HTTP/1.0\r\nHost: %s\r\n%sConnection: close\r\nProxy-Connection: close\r\n",
+                      path, hostname, user_agent_hdr);
+
+    for (int i = 0; i < parser->nheaders; i++) {
+        HttpHeader *header = &parser->headers[i];
+        conn->authorized = conn->authorized || header->id == HDR_AUTHORIZATION;
+        if (IsNeedForward(header)) {
+            memcpy(out + len, header->line.data, header->line.len);
+            len += header->line.len;
+        }
+    }
+    memcpy(out + len, "\r\n", 2);
+    len += 2;
+
+    conn->out = out;
+    conn->out_len = len;
+    conn->out_off = 0;
+    conn->can_cache = 1;
+    conn->host = strdup(hostname);
+    conn->port = strdup(port);
+    if (UpstreamReserve(hostname, port) < 0) {
+        StatsAdd(STAT_ORIGIN_BUSY, 1);
+        ErrorReply(conn, "503", "Service Unavailable");
+        return;
+    }
+    conn->reserved = 1;
+
+    conn->state = RESOLVING;
+    Arm(conn, g_timeouts.connect);
+    Watch(&conn->client, 0);
+    ResolveUpstream(conn);
+}
+
+/**
+ * @brief look origin up without blocking the reactor, and start a
+ * non-blocking connect once its address is known
+ */
+static void ResolveUpstream(Conn *conn)
+{
+    switch (DnsLookup(conn->host, conn->port, &conn->addrs, t_dns_pipe[1])) {
+    case DNS_PENDING:
+        conn->next_resolving = t_resolving;
+        t_resolving = conn;
+        return;
+    case DNS_FAILED:
+        ErrorReply(conn, "502", "Bad Gateway");
+        return;
+    case DNS_RESOLVED:
+        break;
+    }
+
+    conn->addr = 0;
+    conn->state = CONNECTING;
+    ConnectUpstream(conn);
+}
+
+/**
+ * @brief start a non-blocking connect to the next address of the origin from
+ * conn->addr on, all within the connect timeout armed before resolving
+ */
+static void ConnectUpstream(Conn *conn)
+{
+    if ((conn->server.fd = DnsConnect(&conn->addrs, &conn->addr, 1)) < 0) {
+        ErrorReply(conn, "502", "Bad Gateway");
+        return;
+    }
+    Watch(&conn->server, EPOLLOUT);
+}
+
+/**
+ * @brief some lookup finished, retry every connection waiting for one
+ */
+static void ResumeResolving(void)
+{
+    char drain[64];
+    while (read(t_dns_pipe[0], drain, sizeof(drain)) > 0) {
+    }
+
+    Conn *conn = t_resolving;
+    t_resolving = NULL;
+    while (conn != NULL) {
+        Conn *next = conn->next_resolving;
+        ResolveUpstream(conn);
+        conn = next;
+    }
+}
+
+static void FinishConnect(Conn *conn)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(conn->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        /* closing drops fd from the epoll set, the next one is added afresh */
+        close(conn->server.fd);
+        conn->server.fd = -1;
+        conn->server.added = 0;
+        conn->addr++;
+        ConnectUpstream(conn);
+        return;
+    }
+
+    TraceMark(&conn->trace, TIME_CONNECTED);
+    if (conn->tunnel) {
+        /* a fresh socket takes these few bytes whole, or the client is gone */
+        static const char established[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+        ssize_t n = send(conn->client.fd, established, sizeof(established) - 1, MSG_NOSIGNAL);
+        if (n != sizeof(established) - 1) {
+            CloseConn(conn);
+            return;
+        }
+        TraceOutcome(&conn->trace, STAT_TUNNELS);
+        Sent(conn, n);
+    }
+    conn->state = SENDING_REQUEST;
+    conn->expires = g_timeouts.total > 0 && !conn->tunnel ? time(NULL) + g_timeouts.total : 0;
+    SendRequest(conn);
+}
+
+static void SendRequest(Conn *conn)
+{
+    while (conn->out_off < conn->out_len) {
+        ssize_t n = send(conn->server.fd, conn->out + conn->out_off,
+                         conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                Arm(conn, g_timeouts.write);
+                return;
+            }
+            ErrorReply(conn, "502", "Bad Gateway");
+            return;
+        }
+        conn->out_off += n;
+    }
+
+    Free(conn->out);
+    conn->out = NULL;
+    if (conn->tunnel) {
+        StatsAdd(STAT_TUNNEL_BYTES_UP, conn->out_len);
+        OpenTunnel(conn);
+        return;
+    }
+    conn->state = RELAYING;
+    conn->buf_len = 0;
+    conn->buf_off = 0;
+    Relay(conn);
+}
+
+/**
+ * @brief CONNECT host:port, connect to it like to an origin but outside the
+ * pool; bytes the client sent behind the head go first once connected
+ */
+static void StartTunnel(Conn *conn)
+{
+    char *colon = strrchr(conn->url, ':');
+    if (colon == NULL || colon == conn->url || colon[1] == '\0') {
+        ErrorReply(conn, "400", "Bad Request");
+        return;
+    }
+    if (!UpstreamTunnelAllowed(colon + 1)) {
+        ErrorReply(conn, "403", "Forbidden");
+        return;
+    }
+    conn->host = strndup(conn->url, colon - conn->url);
+    conn->port = strdup(colon + 1);
+    conn->tunnel = 1;
+
+    size_t early = conn->buf_len - conn->parser.off;
+    if (early > 0) {
+        conn->out = (char *)Malloc(early);
+        memcpy(conn->out, conn->buf + conn->parser.off, early);
+    }
+    conn->out_len = early;
+    conn->out_off = 0;
+
+    TraceMark(&conn->trace, TIME_LOOKED_UP);
+    if (UpstreamReserve(conn->host, conn->port) < 0) {
+        StatsAdd(STAT_ORIGIN_BUSY, 1);
+        ErrorReply(conn, "503", "Service Unavailable");
+        return;
+    }
+    conn->reserved = 1;
+
+    conn->state = RESOLVING;
+    Arm(conn, g_timeouts.connect);
+    Watch(&conn->client, 0);
+    ResolveUpstream(conn);
+}
+
+static void OpenTunnel(Conn *conn)
+{
+    conn->state = TUNNELING;  // from here CloseConn closes the pipes
+    int ok_up = SpliceDirInit(&conn->up, conn->client.fd, conn->server.fd) == 0;
+    int ok_down = SpliceDirInit(&conn->down, conn->server.fd, conn->client.fd) == 0;
+    if (!ok_up || !ok_down) {
+        CloseConn(conn);
+        return;
+    }
+    Tunnel(conn);
+}
+
+/**
+ * @brief pump both directions of the tunnel, then watch each socket for
+ * what the direction reading it and the one writing it wait for
+ */
+static void Tunnel(Conn *conn)
+{
+    size_t up_bytes = conn->up.bytes;
+    size_t down_bytes = conn->down.bytes;
+    int up_rc = SplicePump(&conn->up, RELAY_BUDGET);
+    int down_rc = SplicePump(&conn->down, RELAY_BUDGET);
+    StatsAdd(STAT_TUNNEL_BYTES_UP, conn->up.bytes - up_bytes);
+    StatsAdd(STAT_TUNNEL_BYTES_DOWN, conn->down.bytes - down_bytes);
+    if (up_rc < 0 || down_rc < 0 || (up_rc == SPLICE_DONE && down_rc == SPLICE_DONE)) {
+        CloseConn(conn);
+        return;
+    }
+
+    Watch(&conn->client, (up_rc == SPLICE_WANT_READ ? EPOLLIN : 0) |
+                         (down_rc == SPLICE_WANT_WRITE ? EPOLLOUT : 0));
+    Watch(&conn->server, (down_rc == SPLICE_WANT_READ ? EPOLLIN : 0) |
+                         (up_rc == SPLICE_WANT_WRITE ? EPOLLOUT : 0));
+    Arm(conn, g_timeouts.tunnel);
+}
+
+/**
+ * @brief copy origin response to client. while client can not take more
+ * bytes, stop reading origin so at most one buf is held per connection
+ */
+static void Relay(Conn *conn)
+{
+    if (conn->pipefd[0] >= 0) {
+        RelaySpliced(conn);
+        return;
+    }
+
+    for (int budget = RELAY_BUDGET; budget > 0; ) {
+        if (conn->buf_off < conn->buf_len) {
+            ssize_t n = send(conn->client.fd, conn->buf + conn->buf_off,
+                             conn->buf_len - conn->buf_off, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN) {
+                    Arm(conn, g_timeouts.write);
+                    Watch(&conn->server, 0);
+                    Watch(&conn->client, EPOLLOUT);
+                    return;
+                }
+                CloseConn(conn);
+                return;
+            }
+            conn->buf_off += n;
+            Sent(conn, n);
+            continue;
+        }
+
+        /* the object will never be cached, let the kernel move the rest */
+        if (!conn->can_cache && SplicePipe(conn->pipefd) == 0) {
+            RelaySpliced(conn);
+            return;
+        }
+
+        ssize_t n = read(conn->server.fd, conn->buf, MAXBUF);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                break;
+            }
+        }
+        if (n <= 0 && conn->trace.at[TIME_FIRST_BYTE] == 0) {
+            ErrorReply(conn, "502", "Bad Gateway");  // origin gone without a byte of response
+            return;
+        }
+        if (n < 0) {
+            CloseConn(conn);
+            return;
+        }
+        if (n == 0) {
+            if (conn->can_cache && conn->head_parsed && ResponseComplete(conn)) {
+                CacheObject(conn->url, strlen(conn->url), &conn->cache, &conn->meta);
+            }
+            CloseConn(conn);
+            return;
+        }
+
+        conn->buf_len = n;
+        conn->buf_off = 0;
+        StageForCache(conn, conn->buf, n);
+        CheckCacheable(conn);
+        budget--;
+    }
+
+    Arm(conn, g_timeouts.read);
+    Watch(&conn->client, 0);
+    Watch(&conn->server, EPOLLIN);
+}
+
+/**
+ * @brief Relay through conn->pipefd with splice, the same flow control as
+ * Relay with the pipe standing in for buf
+ */
+static void RelaySpliced(Conn *conn)
+{
+    for (int budget = RELAY_BUDGET; budget > 0; ) {
+        if (conn->piped > 0) {
+            ssize_t n = SpliceMove(conn->pipefd[0], conn->client.fd, conn->piped);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN) {
+                    Arm(conn, g_timeouts.write);
+                    Watch(&conn->server, 0);
+                    Watch(&conn->client, EPOLLOUT);
+                    return;
+                }
+                CloseConn(conn);
+                return;
+            }
+            conn->piped -= n;
+            Sent(conn, n);
+            continue;
+        }
+
+        ssize_t n = SpliceMove(conn->server.fd, conn->pipefd[1], SPLICE_CHUNK);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                break;
+            }
+            CloseConn(conn);
+            return;
+        }
+        if (n == 0) {
+            CloseConn(conn);
+            return;
+        }
+        conn->piped = n;
+        budget--;
+    }
+
+    Arm(conn, g_timeouts.read);
+    Watch(&conn->client, 0);
+    Watch(&conn->server, EPOLLIN);
+}
+
+static void StageForCache(Conn *conn, char *data, size_t n)
+{
+    if (!conn->can_cache) {
+        return;
+    }
+    if (conn->cache.len + n > MAX_OBJECT_SIZE) {
+        ChainFree(&conn->cache);
+        conn->can_cache = 0;
+        return;
+    }
+    ChainAppend(&conn->cache, data, n);
+}
+
+/**
+ * @brief once the response header is staged, cache only what it allows. the
+ * header must fit in the first chunk of the copy, it may arrive in pieces
+ */
+static void CheckCacheable(Conn *conn)
+{
+    if (!conn->can_cache || conn->head_parsed) {
+        return;
+    }
+
+    ResponseHead *head = &conn->head;
+    Chunk *first = conn->cache.head;
+    if (!ParseResponseBuffer(first->data, first->len, head)) {
+        if (first->len == CHUNK_SIZE) {
+            ChainFree(&conn->cache);
+            conn->can_cache = 0;
+        }
+        return;
+    }
+
+    conn->head_parsed = 1;
+    if (!ResponseCacheable(head, conn->authorized) || head->content_length > MAX_OBJECT_SIZE) {
+        ChainFree(&conn->cache);
+        conn->can_cache = 0;
+        return;
+    }
+    CacheMetaInit(&conn->meta, head);
+}
+
+/**
+ * @return 1 if conn->cache holds the whole response once origin closed: the
+ * whole chunked body through its last chunk, or Content-Length body bytes
+ */
+static int ResponseComplete(Conn *conn)
+{
+    ResponseHead *head = &conn->head;
+    if (!ResponseHasBody(head)) {
+        return 1;
+    }
+    if (head->chunked) {
+        ChunkedScan scan;
+        ChunkedScanInit(&scan);
+        size_t skip = head->head_len;
+        int rc = 0;
+        for (Chunk *chunk = conn->cache.head; chunk != NULL && rc == 0; chunk = chunk->next) {
+            if (skip >= chunk->len) {
+                skip -= chunk->len;
+                continue;
+            }
+            rc = ChunkedScanFeed(&scan, chunk->data + skip, chunk->len - skip);
+            skip = 0;
+        }
+        return rc == 1;
+    }
+    return head->content_length < 0 || conn->cache.len - head->head_len == (size_t)head->content_length;
+}
+
+/**
+ * @return 1 if one of the headers of the request takes gzip
+ */
+static int RequestAcceptsGzip(const HttpParser *parser)
+{
+    for (int i = 0; i < parser->nheaders; i++) {
+        if (AcceptsGzip(&parser->headers[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void SendCached(Conn *conn)
+{
+    Chain *object = conn->sending;
+    while (conn->entry_off < object->len) {
+        ssize_t n = ChainWritev(conn->client.fd, object, conn->entry_off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                Arm(conn, g_timeouts.write);
+                Watch(&conn->client, EPOLLOUT);
+                return;
+            }
+            break;
+        }
+        conn->entry_off += n;
+        Sent(conn, n);
+    }
+    CloseConn(conn);
+}
+
+static void SendDisk(Conn *conn)
+{
+    while (conn->entry_off < conn->disk.len) {
+        ssize_t n = DiskSendfile(&conn->disk, conn->client.fd, conn->entry_off);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN) {
+                Arm(conn, g_timeouts.write);
+                Watch(&conn->client, EPOLLOUT);
+                return;
+            }
+            break;
+        }
+        conn->entry_off += n;
+        Sent(conn, n);
+    }
+    CloseConn(conn);
+}
+
+/**
+ * @brief best-effort error page, the connection is closed right after
+ */
+static void ErrorReply(Conn *conn, char *errnum, char *shortmsg)
+{
+    char buf[MAXLINE];
+    int len = snprintf(buf, MAXLINE,
+                       "HTTP/1.0 %s %s\r\nContent-type: text/html\r\n\r\n"
+                       "<html><title>Proxy Error</title><body bgcolor=ffffff>\r\n"
+                       "%s: %s\r\n<hr><em>The Proxy server</em>\r\n",
+                       errnum, shortmsg, errnum, shortmsg);
+    ssize_t n = send(conn->client.fd, buf, len, MSG_NOSIGNAL);
+    if (n > 0) {
+        Sent(conn, n);
+    }
+    CloseConn(conn);
+}
+
+/**
+ * @brief n more bytes went to the client. the first of a relayed response
+ * makes the request a miss
+ */
+static void Sent(Conn *conn, size_t n)
+{
+    StatsAdd(STAT_BYTES_OUT, n);
+    if (conn->trace.at[TIME_FIRST_BYTE] == 0) {
+        TraceMark(&conn->trace, TIME_FIRST_BYTE);
+        if (conn->state == RELAYING) {
+            TraceOutcome(&conn->trace, STAT_MISSES);
+        }
+    }
+}
+
+static inline void Arm(Conn *conn, int seconds)
+{
+    conn->deadline = seconds > 0 ? time(NULL) + seconds : 0;
+}
+
+/**
+ * @brief end connections whose wait or response took too long, with a 504
+ * if the client is waiting for an origin that has not answered yet
+ */
+static void ExpireConns(void)
+{
+    time_t now = time(NULL);
+    t_swept = now;
+    Conn *next;
+    for (Conn *conn = t_live; conn != NULL; conn = next) {
+        next = conn->next_live;
+        if ((conn->deadline == 0 || now < conn->deadline) &&
+            (conn->expires == 0 || now < conn->expires)) {
+            continue;
+        }
+
+        StatsAdd(STAT_TIMEOUTS, 1);
+        int answered = conn->trace.at[TIME_FIRST_BYTE] != 0;
+        switch (conn->state) {
+        case RESOLVING:
+        case CONNECTING:
+        case SENDING_REQUEST:
+        case RELAYING:
+            if (!answered) {
+                ErrorReply(conn, "504", "Gateway Timeout");
+                break;
+            }
+            CloseConn(conn);
+            break;
+        default:
+            CloseConn(conn);
+            break;
+        }
+    }
+}
+
+static void CloseConn(Conn *conn)
+{
+    /* a client that left before sending a whole head made no request */
+    if (conn->trace.at[TIME_PARSED] != 0) {
+        long long us = TraceFinish(&conn->trace);
+        LogPrintf("%s %s %lld us\n", conn->url != NULL ? conn->url : "-",
+                  StatsName(conn->trace.outcome), us);
+    }
+    conn->closed = 1;
+    close(conn->client.fd);
+    if (conn->server.fd >= 0) {
+        close(conn->server.fd);
+    }
+    if (conn->pipefd[0] >= 0) {
+        close(conn->pipefd[0]);
+        close(conn->pipefd[1]);
+    }
+    if (conn->entry != NULL) {
+        ReleaseObject(conn->entry);
+    }
+    if (conn->disk.segment != NULL) {
+        DiskRelease(&conn->disk);
+    }
+    if (conn->state == TUNNELING) {
+        SpliceDirClose(&conn->up);
+        SpliceDirClose(&conn->down);
+    }
+    if (conn->state == RESOLVING) {
+        Conn **link = &t_resolving;
+        while (*link != NULL && *link != conn) {
+            link = &(*link)->next_resolving;
+        }
+        if (*link != NULL) {
+            *link = conn->next_resolving;
+        }
+    }
+    if (conn->reserved) {
+        UpstreamUnreserve(conn->host, conn->port);
+    }
+    if (conn->prev_live != NULL) {
+        conn->prev_live->next_live = conn->next_live;
+    } else {
+        t_live = conn->next_live;
+    }
+    if (conn->next_live != NULL) {
+        conn->next_live->prev_live = conn->prev_live;
+    }
+    Free(conn->out);
+    Free(conn->url);
+    Free(conn->host);
+    Free(conn->port);
+    ChainFree(&conn->cache);
+
+    conn->next_free = t_closed;
+    t_closed = conn;
+}
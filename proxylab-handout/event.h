@@ -0,0 +1,26 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+/**
+ * event-driven proxy engine: each reactor thread multiplexes its client and
+ * origin sockets with epoll, every connection is driven by a small state
+ * machine instead of blocking a worker thread. reactors share nothing but the
+ * cache; each one accepts on its own SO_REUSEPORT listening socket, so the
+ * kernel spreads new connections across them without a shared accept lock.
+ */
+
+#define MAX_EVENTS 256
+#define RELAY_BUDGET 16  // reads relayed per event before yielding to other connections
+#define SWEEP_INTERVAL 1000  // ms between looks for connections past their deadline
+
+/**
+ * @brief start nreactors event loops listening on port, never returns
+ */
+void RunReactors(char *port, int nreactors);
+
+/**
+ * @brief serve connections accepted on listenfd forever in calling thread
+ */
+void EventLoop(int listenfd);
+
+#endif
@@ -0,0 +1,309 @@
+#include "csapp.h"
+#include "flight.h"
+#include "stats.h"
+
+static Flight *g_flights[FLIGHT_BUCKETS];
+/* guards g_flights, and refcnt, registered and cacheable of every flight */
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static Flight *NewFlight(char *url);
+static Flight **FindFlight(char *url);
+static void Unregister(Flight *flight);
+static void Trim(Flight *flight);
+static void MakeRoom(Flight *flight);
+
+Flight *FlightJoin(char *url, int *leader)
+{
+    pthread_mutex_lock(&g_mutex);
+    Flight **link = FindFlight(url);
+    Flight *flight = *link;
+    if (flight != NULL) {
+        flight->refcnt++;
+        pthread_mutex_unlock(&g_mutex);
+        *leader = 0;
+        return flight;
+    }
+
+    flight = NewFlight(url);
+    flight->registered = 1;
+    *link = flight;
+    pthread_mutex_unlock(&g_mutex);
+    *leader = 1;
+    return flight;
+}
+
+Flight *FlightSolo(char *url)
+{
+    return NewFlight(url);
+}
+
+void FlightAppend(Flight *flight, const char *data, size_t n)
+{
+    pthread_mutex_lock(&flight->lock);
+    MakeRoom(flight);
+    ChainAppend(&flight->object, data, n);
+    pthread_cond_broadcast(&flight->grown);
+    pthread_mutex_unlock(&flight->lock);
+}
+
+void FlightAppendChain(Flight *flight, Chain *chain)
+{
+    pthread_mutex_lock(&flight->lock);
+    MakeRoom(flight);
+    for (Chunk *chunk = chain->head; chunk != NULL; chunk = chunk->next) {
+        ChainAppend(&flight->object, chunk->data, chunk->len);
+    }
+    pthread_cond_broadcast(&flight->grown);
+    pthread_mutex_unlock(&flight->lock);
+}
+
+char *FlightReserve(Flight *flight, size_t *space)
+{
+    pthread_mutex_lock(&flight->lock);
+    MakeRoom(flight);
+    char *data = ChainReserve(&flight->object, space);
+    pthread_mutex_unlock(&flight->lock);
+    return data;
+}
+
+void FlightCommit(Flight *flight, size_t n)
+{
+    pthread_mutex_lock(&flight->lock);
+    ChainCommit(&flight->object, n);
+    pthread_cond_broadcast(&flight->grown);
+    pthread_mutex_unlock(&flight->lock);
+}
+
+int FlightUncacheable(Flight *flight, int shared)
+{
+    pthread_mutex_lock(&g_mutex);
+    flight->cacheable = 0;
+    Unregister(flight);
+    int alone = flight->refcnt == 1;
+    pthread_mutex_unlock(&g_mutex);
+
+    /* followers that got nothing yet try by themselves, see FlightSend */
+    if (!shared) {
+        pthread_mutex_lock(&flight->lock);
+        if (flight->state == FLIGHT_FETCHING) {
+            flight->state = FLIGHT_FAILED;
+            pthread_cond_broadcast(&flight->grown);
+        }
+        pthread_mutex_unlock(&flight->lock);
+    }
+
+    /* unregistered, so nobody can join and read object anymore */
+    pthread_mutex_lock(&flight->lock);
+    if (alone) {
+        ChainFree(&flight->object);
+    } else if (shared) {
+        flight->windowed = 1;
+    }
+    pthread_mutex_unlock(&flight->lock);
+    return alone;
+}
+
+void FlightFinish(Flight *flight, FlightState state, const CacheMeta *meta)
+{
+    pthread_mutex_lock(&flight->lock);
+    if (flight->state != FLIGHT_FETCHING) {
+        pthread_mutex_unlock(&flight->lock);
+        return;
+    }
+    flight->state = state;
+    if (meta != NULL) {
+        flight->meta = *meta;
+    }
+    Trim(flight);
+    pthread_cond_broadcast(&flight->grown);
+    pthread_mutex_unlock(&flight->lock);
+
+    /* a complete object is served to new misses until it is cached */
+    if (state == FLIGHT_FAILED) {
+        pthread_mutex_lock(&g_mutex);
+        Unregister(flight);
+        pthread_mutex_unlock(&g_mutex);
+    }
+}
+
+int FlightSend(Flight *flight, int connfd, int keep_alive, int *framed)
+{
+    struct iovec iov[CHAIN_IOV_MAX];
+    FlightReader reader;
+    reader.off = 0;
+    *framed = 0;
+
+    pthread_mutex_lock(&flight->lock);
+    if (flight->base > 0) {
+        pthread_mutex_unlock(&flight->lock);
+        return -1;  // joined too late, the start is dropped already
+    }
+    reader.next = flight->readers;
+    flight->readers = &reader;
+
+    int failed = 0;
+    while (1) {
+        size_t end = flight->base + flight->object.len;
+        while (reader.off == end && flight->state == FLIGHT_FETCHING) {
+            pthread_cond_wait(&flight->grown, &flight->lock);
+            end = flight->base + flight->object.len;
+        }
+        /* a flight failed before this follower sent anything is not sent from */
+        if (reader.off == end || (reader.off == 0 && flight->state == FLIGHT_FAILED)) {
+            break;
+        }
+
+        /* the leader publishes the response head in one piece */
+        Chunk *first = flight->object.head;
+        size_t at = reader.off == 0 && !keep_alive ? KeepAliveAt(first->data, first->len) : 0;
+        if (at > 0) {
+            pthread_mutex_unlock(&flight->lock);
+            ssize_t n = WriteClosingHead(connfd, first->data, at);
+            pthread_mutex_lock(&flight->lock);
+            if (n < 0) {
+                failed = 1;
+                break;
+            }
+            reader.off = at + strlen(KEEP_ALIVE_LINE);
+            StatsAdd(STAT_BYTES_OUT, n);
+            continue;
+        }
+
+        /*
+         * bytes already in object never change, and chunks at or past
+         * reader.off are not dropped, so write them without the lock
+         */
+        int iovcnt = ChainIovec(&flight->object, reader.off - flight->base, iov);
+        pthread_mutex_unlock(&flight->lock);
+        ssize_t n = writev(connfd, iov, iovcnt);
+        pthread_mutex_lock(&flight->lock);
+        if (n < 0 && errno != EINTR) {
+            failed = 1;
+            break;
+        }
+        if (n > 0) {
+            reader.off += n;
+            StatsAdd(STAT_BYTES_OUT, n);
+            if (flight->windowed) {
+                pthread_cond_broadcast(&flight->grown);  // the leader may wait for room
+            }
+        }
+    }
+
+    FlightReader **link = &flight->readers;
+    while (*link != &reader) {
+        link = &(*link)->next;
+    }
+    *link = reader.next;
+    if (flight->windowed) {
+        pthread_cond_broadcast(&flight->grown);
+    }
+
+    int rc = failed ? 0 : flight->state == FLIGHT_COMPLETE ? 1 : (reader.off == 0 ? -1 : 0);
+    *framed = flight->meta.framed;
+    pthread_mutex_unlock(&flight->lock);
+    return rc;
+}
+
+void FlightRelease(Flight *flight)
+{
+    pthread_mutex_lock(&g_mutex);
+    if (--flight->refcnt != 0) {
+        pthread_mutex_unlock(&g_mutex);
+        return;
+    }
+
+    int cache = flight->state == FLIGHT_COMPLETE && flight->cacheable;
+    Unregister(flight);
+    pthread_mutex_unlock(&g_mutex);
+
+    /*
+     * compressing and spilling happen outside g_mutex, so joins and releases
+     * of other urls do not wait for them. a miss of url meanwhile finds
+     * neither the flight nor the entry and fetches it again
+     */
+    if (cache) {
+        CacheObject(flight->url, strlen(flight->url), &flight->object, &flight->meta);
+    }
+
+    ChainFree(&flight->object);
+    pthread_mutex_destroy(&flight->lock);
+    pthread_cond_destroy(&flight->grown);
+    Free(flight->url);
+    Free(flight);
+}
+
+static Flight *NewFlight(char *url)
+{
+    Flight *flight = (Flight *)Calloc(1, sizeof(Flight));
+    flight->url = strdup(url);
+    flight->refcnt = 1;
+    flight->cacheable = 1;
+    pthread_mutex_init(&flight->lock, NULL);
+    pthread_cond_init(&flight->grown, NULL);
+    ChainInit(&flight->object);
+    flight->state = FLIGHT_FETCHING;
+    return flight;
+}
+
+/**
+ * @return link to the flight of url in its bucket, or to the NULL ending the
+ * bucket. caller must hold g_mutex
+ */
+static Flight **FindFlight(char *url)
+{
+    unsigned long hash = 5381;
+    for (char *p = url; *p != '\0'; p++) {
+        hash = hash * 33 + (unsigned char)*p;
+    }
+
+    Flight **link = &g_flights[hash & (FLIGHT_BUCKETS - 1)];
+    while (*link != NULL && strcmp((*link)->url, url) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/**
+ * @brief drop the chunks of a windowed object every reader has sent, all of
+ * them with no reader left. caller must hold flight->lock
+ */
+static void Trim(Flight *flight)
+{
+    if (!flight->windowed) {
+        return;
+    }
+    size_t slowest = flight->base + flight->object.len;
+    for (FlightReader *reader = flight->readers; reader != NULL; reader = reader->next) {
+        if (reader->off < slowest) {
+            slowest = reader->off;
+        }
+    }
+    flight->base += ChainDropFront(&flight->object, slowest - flight->base);
+}
+
+/**
+ * @brief leader waits until a windowed object has room for more. caller
+ * must hold flight->lock
+ */
+static void MakeRoom(Flight *flight)
+{
+    Trim(flight);
+    while (flight->windowed && flight->object.len >= FLIGHT_WINDOW) {
+        pthread_cond_wait(&flight->grown, &flight->lock);
+        Trim(flight);
+    }
+}
+
+/**
+ * @brief caller must hold g_mutex
+ */
+static void Unregister(Flight *flight)
+{
+    if (!flight->registered) {
+        return;
+    }
+    Flight **link = FindFlight(flight->url);
+    *link = flight->next;
+    flight->registered = 0;
+}
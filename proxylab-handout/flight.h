@@ -0,0 +1,122 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <pthread.h>
+#include "chunk.h"
+#include "cache.h"
+
+/**
+ * cache misses in flight, keyed by url. the first client to miss a url becomes
+ * the leader and fetches it from the origin; clients missing the same url
+ * meanwhile join the flight as followers instead of fetching it again.
+ *
+ * the leader appends the response to the flight's object as it arrives, and
+ * followers stream it from there to their clients as it grows, so they get
+ * the first byte about as soon as the leader does. once every reader is done
+ * the object goes to the cache, the flight stays joinable until then.
+ * an object too big to cache is still shared with the followers that already
+ * joined, but no new ones can join; with nobody following the leader stops
+ * keeping it at all. what is shared then is a window of FLIGHT_WINDOW bytes:
+ * the bytes every follower has sent are dropped, and the leader waits for the
+ * slowest follower while the window is full. a response private to the
+ * leader's client, or varying by request headers, is not shared at all,
+ * followers fetch it by themselves.
+ */
+
+#define FLIGHT_BUCKETS 256  // must be a power of 2
+#define FLIGHT_WINDOW MAX_OBJECT_SIZE  // bytes kept for followers of an uncacheable object
+
+typedef enum {
+    FLIGHT_FETCHING,  // leader is still receiving the response
+    FLIGHT_COMPLETE,  // whole response is in object
+    FLIGHT_FAILED,    // leader gave up, object is cut short
+} FlightState;
+
+/* a follower in FlightSend, on the list of its flight */
+typedef struct FlightReader {
+    size_t off;  // response bytes sent so far
+    struct FlightReader *next;
+} FlightReader;
+
+typedef struct Flight {
+    char *url;
+    int refcnt;      // leader and followers
+    int registered;  // in the flight table, so new misses of url join it
+    int cacheable;
+    pthread_mutex_t lock;  // guards object and everything below
+    pthread_cond_t grown;  // object grew or state changed, or a reader moved on
+    Chain object;    // response as sent to clients, appended by the leader only
+    size_t base;     // response offset of object's first byte, once windowed
+    int windowed;    // uncacheable with followers, bytes all readers sent are dropped
+    FlightReader *readers;
+    FlightState state;
+    CacheMeta meta;  // set once complete
+    struct Flight *next;
+} Flight;
+
+/**
+ * @param leader[out] 1 if caller started the flight and must fetch url, then
+ * end the flight with FlightFinish
+ * @return referenced flight, drop it with FlightRelease
+ */
+Flight *FlightJoin(char *url, int *leader);
+
+/**
+ * @brief start a flight nobody can join, caller leads it
+ */
+Flight *FlightSolo(char *url);
+
+/**
+ * @brief leader adds bytes to object, and wakes followers
+ */
+void FlightAppend(Flight *flight, const char *data, size_t n);
+
+/**
+ * @brief leader adds a copy of chain to object, and wakes followers
+ */
+void FlightAppendChain(Flight *flight, Chain *chain);
+
+/**
+ * @brief leader reserves space at the end of object, like ChainReserve
+ */
+char *FlightReserve(Flight *flight, size_t *space);
+
+/**
+ * @brief leader publishes n bytes written to reserved space, and wakes followers
+ */
+void FlightCommit(Flight *flight, size_t n);
+
+/**
+ * @brief leader learned the object must not be cached, no one joins from now on
+ * @param shared 0 if followers must not see the response either, they are
+ * sent off to fetch it by themselves. only before anything was appended,
+ * and nothing may be appended after it
+ * @return 1 if nobody follows, object is dropped then and must not be
+ * appended to anymore
+ */
+int FlightUncacheable(Flight *flight, int shared);
+
+/**
+ * @brief leader ends the flight and wakes followers, later calls are ignored
+ * @param state FLIGHT_COMPLETE or FLIGHT_FAILED
+ * @param meta how to cache a complete object, NULL if failed
+ */
+void FlightFinish(Flight *flight, FlightState state, const CacheMeta *meta);
+
+/**
+ * @brief follower sends object to connfd as it grows, until the leader ends
+ * the flight
+ * @param keep_alive client keeps its connection, otherwise a KEEP_ALIVE_LINE
+ * after the status line goes out as CLOSE_LINE
+ * @param framed[out] response ends by itself
+ * @return 1 if the whole response was sent, 0 if it was cut short, -1 if the
+ * leader failed before sending anything so the caller may try by itself
+ */
+int FlightSend(Flight *flight, int connfd, int keep_alive, int *framed);
+
+/**
+ * @brief drop a reference, the last one caches a complete cacheable object
+ */
+void FlightRelease(Flight *flight);
+
+#endif
@@ -0,0 +1,85 @@
+#include <zlib.h>
+#include "gzip.h"
+
+#define GZIP_WINDOW (15 + 16)  // largest window, gzip wrapper instead of zlib's
+
+static int Pump(z_stream *zs, Chain *src, size_t off, Chain *dst, int compress);
+static int Drain(z_stream *zs, Chain *dst, int compress, int flush);
+
+int GzipChain(Chain *src, size_t off, Chain *dst)
+{
+    z_stream zs = {0};
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    int rc = Pump(&zs, src, off, dst, 1);
+    deflateEnd(&zs);
+    return rc;
+}
+
+int GunzipChain(Chain *src, size_t off, Chain *dst)
+{
+    z_stream zs = {0};
+    if (inflateInit2(&zs, GZIP_WINDOW) != Z_OK) {
+        return -1;
+    }
+    int rc = Pump(&zs, src, off, dst, 0);
+    inflateEnd(&zs);
+    return rc;
+}
+
+/**
+ * @brief feed src chunk by chunk through zs, writing straight into the free
+ * space at the end of dst
+ */
+static int Pump(z_stream *zs, Chain *src, size_t off, Chain *dst, int compress)
+{
+    int rc = Z_OK;
+    for (Chunk *chunk = src->head; chunk != NULL && rc != Z_STREAM_END; chunk = chunk->next) {
+        if (off >= chunk->len) {
+            off -= chunk->len;
+            continue;
+        }
+        zs->next_in = (Bytef *)chunk->data + off;
+        zs->avail_in = chunk->len - off;
+        off = 0;
+        if ((rc = Drain(zs, dst, compress, Z_NO_FLUSH)) < 0) {
+            return -1;
+        }
+    }
+
+    /* deflate has to be told the input is over */
+    if (compress) {
+        zs->avail_in = 0;
+        rc = Drain(zs, dst, compress, Z_FINISH);
+    }
+    return rc == Z_STREAM_END ? 0 : -1;
+}
+
+/**
+ * @return zlib's last status once the input is used up, or the stream
+ * ended, -1 on error
+ */
+static int Drain(z_stream *zs, Chain *dst, int compress, int flush)
+{
+    int rc;
+    do {
+        size_t space;
+        zs->next_out = (Bytef *)ChainReserve(dst, &space);
+        zs->avail_out = space;
+        rc = compress ? deflate(zs, flush) : inflate(zs, flush);
+        ChainCommit(dst, space - zs->avail_out);
+        /*
+         * Z_BUF_ERROR only says no progress was possible: the last round
+         * filled dst exactly and the input is used up. it takes more input,
+         * or more space if dst is full again, not an error
+         */
+        if (rc == Z_BUF_ERROR) {
+            rc = Z_OK;
+        }
+        if (rc != Z_OK && rc != Z_STREAM_END) {
+            return -1;
+        }
+    } while (rc != Z_STREAM_END && (zs->avail_out == 0 || flush == Z_FINISH));
+    return rc;
+}
@@ -0,0 +1,29 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include "chunk.h"
+
+/**
+ * gzip (RFC 1952) streams between chains, with zlib. the cache compresses a
+ * body once when it caches it, so the fastest level is used: text still
+ * shrinks several times, and most clients get the compressed bytes as is.
+ */
+
+#define GZIP_LEVEL 1        // Z_BEST_SPEED
+#define GZIP_MIN_SIZE 1024  // smaller bodies are not worth it
+#define GZIP_MIN_SAVING 8   // keep compressed bodies at most 7/8 of the original
+
+/**
+ * @brief append the gzip stream of src's bytes from offset off on to dst
+ * @return 0, or -1 if zlib failed
+ */
+int GzipChain(Chain *src, size_t off, Chain *dst);
+
+/**
+ * @brief append what the gzip stream in src from offset off on decompresses
+ * to to dst
+ * @return 0, or -1 if the stream is corrupt or cut short
+ */
+int GunzipChain(Chain *src, size_t off, Chain *dst);
+
+#endif
@@ -0,0 +1,567 @@
+#include <assert.h>
+#include "csapp.h"
+#include "http.h"
+
+/* You won't lose style points for including this long line in your code */
+const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+
+static int HasToken(const char *value, const char *token);
+static void ParseCacheControl(const char *value, ResponseHead *head);
+static time_t ParseHttpDate(const char *value);
+static void CopyValue(char *dst, const char *value);
+static int IsTextual(const char *value);
+static int VariesBeyondEncoding(const char *value);
+static void ResetHead(ResponseHead *head);
+
+/**
+ * @param url[in]: e.g. http://www.cmu.edu/hub/index.html
+ * @param url_length: the length of url-array
+ * @param hostname[out]: www.cmu.edu
+ * @param path[out]: /hub/index.html
+ * @param len: the length of hostname-array and path-array
+ */
+void ParseHostnamePath(char *url, int url_length, char *hostname, char *path, int len)
+{
+    char prefix[] = "http://";
+    const int prefix_length = 7;
+    int hostname_length = 0;
+    int path_length = 0;
+    int end_parse_hostname = 0;
+
+    for (int i = 0; i < url_length; i++) {
+        if (i < prefix_length) {
+            assert(prefix[i] == url[i]);
+            continue;
+        }
+
+        if (!end_parse_hostname) {
+            if (url[i] == '\0' || url[i] == '/') {
+                path[path_length] = '/';
+                path_length++;
+                path[path_length] = '\0';
+                end_parse_hostname = 1;
+                continue;
+            }
+            hostname[hostname_length] = url[i];
+            hostname_length++;
+            hostname[hostname_length] = '\0';
+            continue;
+        }
+
+        if (url[i] == '\0') {
+            break;
+        }
+        path[path_length] = url[i];
+        path_length++;
+        path[path_length] = '\0';
+    }
+}
+
+/**
+ * if hostname specifys a port, cut the port from hostname
+ * @return 1 if hostname specify the port, otherwise 0
+ */
+int ExtractPort(char *hostname, int host_len, char *port, int port_len)
+{
+    for (int i = 0; i < host_len; i++) {
+        if (hostname[i] == ':') {
+            strcpy(port, hostname + i + 1);
+            hostname[i] = '\0';
+            return 1;
+        }
+
+        if (hostname[i] == '\0') {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Host and User-Agent are sent by the proxy itself, hop-by-hop headers
+ * are not passed on. neither is Accept-Encoding: responses are shared by url
+ * alone, so the origin is asked for the identity form, which the cache
+ * compresses by itself for the clients that take it
+ * @return 1 if the request header is forwarded to server, otherwise 0
+ */
+int IsNeedForward(const HttpHeader *header)
+{
+    return header->id != HDR_HOST && header->id != HDR_USER_AGENT && header->id != HDR_ACCEPT_ENCODING &&
+           !IsHopByHop(header);
+}
+
+/**
+ * @return 1 if token appears in value, ignoring case
+ */
+static int HasToken(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+    for (; *value != '\0'; value++) {
+        if (strncasecmp(value, token, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void ParseStatusLine(const char *line, ResponseHead *head)
+{
+    ResetHead(head);
+    sscanf(line, "HTTP/1.%d %d", &head->version_minor, &head->status);
+}
+
+static void ResetHead(ResponseHead *head)
+{
+    head->version_minor = 0;
+    head->status = 0;
+    head->content_length = -1;
+    head->chunked = 0;
+    head->conn_close = 0;
+    head->conn_keep_alive = 0;
+    head->no_store = 0;
+    head->no_cache = 0;
+    head->is_private = 0;
+    head->is_public = 0;
+    head->must_revalidate = 0;
+    head->max_age = -1;
+    head->s_maxage = -1;
+    head->age = 0;
+    head->date = -1;
+    head->expires = -1;
+    head->etag[0] = '\0';
+    head->last_modified[0] = '\0';
+    head->encoded = 0;
+    head->textual = 0;
+    head->vary = 0;
+    head->vary_other = 0;
+    head->head_len = 0;
+}
+
+void ParseResponseHeader(const HttpHeader *header, ResponseHead *head)
+{
+    if (header->id == HDR_OTHER) {
+        return;
+    }
+
+    char value[MAXLINE];
+    SliceCopy(header->value, value, MAXLINE);
+    switch (header->id) {
+    case HDR_CONTENT_LENGTH:
+        head->content_length = strtol(value, NULL, 10);
+        break;
+    case HDR_TRANSFER_ENCODING:
+        head->chunked = HasToken(value, "chunked");
+        break;
+    case HDR_CACHE_CONTROL:
+        ParseCacheControl(value, head);
+        break;
+    case HDR_EXPIRES: {
+        time_t expires = ParseHttpDate(value);
+        head->expires = expires < 0 ? 0 : expires;
+        break;
+    }
+    case HDR_DATE:
+        head->date = ParseHttpDate(value);
+        break;
+    case HDR_AGE:
+        head->age = strtol(value, NULL, 10);
+        break;
+    case HDR_ETAG:
+        CopyValue(head->etag, value);
+        break;
+    case HDR_LAST_MODIFIED:
+        CopyValue(head->last_modified, value);
+        break;
+    case HDR_CONTENT_ENCODING:
+        head->encoded = !HasToken(value, "identity");
+        break;
+    case HDR_CONTENT_TYPE:
+        head->textual = IsTextual(value);
+        break;
+    case HDR_VARY:
+        head->vary = 1;
+        head->vary_other = head->vary_other || VariesBeyondEncoding(value);
+        break;
+    default:
+        ParseConnectionHeader(header, &head->conn_close, &head->conn_keep_alive);
+        break;
+    }
+}
+
+/**
+ * @brief note close / keep-alive if header is Connection or Proxy-Connection
+ */
+void ParseConnectionHeader(const HttpHeader *header, int *conn_close, int *conn_keep_alive)
+{
+    if (header->id != HDR_CONNECTION && header->id != HDR_PROXY_CONNECTION) {
+        return;
+    }
+
+    char value[MAXLINE];
+    SliceCopy(header->value, value, MAXLINE);
+    if (HasToken(value, "close")) {
+        *conn_close = 1;
+    }
+    if (HasToken(value, "keep-alive")) {
+        *conn_keep_alive = 1;
+    }
+}
+
+/**
+ * @brief parse the status line and headers at the start of buf
+ * @return 1 if buf holds the whole header, 0 if it is cut short
+ */
+int ParseResponseBuffer(const char *buf, size_t len, ResponseHead *head)
+{
+    HttpParser parser;
+    HttpParserInit(&parser, 1);
+    if (HttpParse(&parser, buf, len) != HTTP_DONE) {
+        return 0;
+    }
+
+    ResetHead(head);
+    head->version_minor = parser.version_minor;
+    head->status = parser.status;
+    head->head_len = parser.off;
+    for (int i = 0; i < parser.nheaders; i++) {
+        ParseResponseHeader(&parser.headers[i], head);
+    }
+    return 1;
+}
+
+size_t KeepAliveAt(const char *object, size_t n)
+{
+    const char *eol = memchr(object, '\n', n);
+    if (eol == NULL) {
+        return 0;
+    }
+    size_t at = eol + 1 - object;
+    size_t len = strlen(KEEP_ALIVE_LINE);
+    return n - at >= len && memcmp(object + at, KEEP_ALIVE_LINE, len) == 0 ? at : 0;
+}
+
+ssize_t WriteClosingHead(int fd, const char *object, size_t at)
+{
+    struct iovec iov[2];
+    iov[0].iov_base = (char *)object;
+    iov[0].iov_len = at;
+    iov[1].iov_base = CLOSE_LINE;
+    iov[1].iov_len = strlen(CLOSE_LINE);
+    return rio_writevn(fd, iov, 2);
+}
+
+/**
+ * @return 1 if header is an Accept-Encoding that takes gzip, a "gzip;q=0"
+ * turns it down
+ */
+int AcceptsGzip(const HttpHeader *header)
+{
+    if (header->id != HDR_ACCEPT_ENCODING) {
+        return 0;
+    }
+
+    char value[MAXLINE];
+    SliceCopy(header->value, value, MAXLINE);
+    char *save;
+    for (char *coding = strtok_r(value, ",", &save); coding != NULL;
+         coding = strtok_r(NULL, ",", &save)) {
+        coding += strspn(coding, " \t");
+        size_t len = strcspn(coding, " \t;");
+        if ((len == 4 && strncasecmp(coding, "gzip", 4) == 0) ||
+            (len == 6 && strncasecmp(coding, "x-gzip", 6) == 0)) {
+            char *q = strstr(coding + len, "q=");
+            return q == NULL || strtod(q + 2, NULL) > 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @return 1 for headers that only concern one connection and must not be
+ * passed on by the proxy
+ */
+int IsHopByHop(const HttpHeader *header)
+{
+    return header->id == HDR_CONNECTION || header->id == HDR_PROXY_CONNECTION ||
+           header->id == HDR_KEEP_ALIVE;
+}
+
+/**
+ * @return 1 for If-Match, If-None-Match, If-Modified-Since, If-Unmodified-Since
+ * and If-Range, which can turn the response into a 304 or 412
+ */
+int IsConditional(const HttpHeader *header)
+{
+    return header->id == HDR_IF_MATCH || header->id == HDR_IF_NONE_MATCH ||
+           header->id == HDR_IF_MODIFIED_SINCE || header->id == HDR_IF_UNMODIFIED_SINCE ||
+           header->id == HDR_IF_RANGE;
+}
+
+/**
+ * @return 0 if the response to a GET ends right after its header
+ */
+int ResponseHasBody(const ResponseHead *head)
+{
+    return !(head->status / 100 == 1 || head->status == 204 || head->status == 304);
+}
+
+/**
+ * @return 1 if the end of the response is known without the server closing
+ * the connection
+ */
+int ResponseFramed(const ResponseHead *head)
+{
+    return !ResponseHasBody(head) || head->chunked || head->content_length >= 0;
+}
+
+/**
+ * @return 1 if the connection can carry another request once the response is
+ * read, which needs both the server's consent and a known end of body
+ */
+int ResponseKeepAlive(const ResponseHead *head)
+{
+    int persistent = head->version_minor >= 1 ? !head->conn_close : head->conn_keep_alive;
+    return persistent && ResponseFramed(head);
+}
+
+/**
+ * @return 1 if a shared cache may store the response. statuses that are
+ * cacheable by default may go without freshness information, others need it
+ * to be explicit
+ * @param authorized the request carried Authorization, its response is for
+ * that user alone unless it says otherwise (RFC 9111 3.5)
+ */
+int ResponseCacheable(const ResponseHead *head, int authorized)
+{
+    if (head->no_store || head->is_private) {
+        return 0;
+    }
+    if (authorized && !head->is_public && head->s_maxage < 0 && !head->must_revalidate) {
+        return 0;
+    }
+    /* the cache is keyed by url alone, a response for some clients only is not kept */
+    if (head->vary_other || head->encoded) {
+        return 0;
+    }
+
+    int explicit = head->s_maxage >= 0 || head->max_age >= 0 || head->expires >= 0;
+    switch (head->status) {
+    case 200:
+    case 203:
+    case 300:
+    case 301:
+        return 1;
+    case 204:
+    case 404:
+    case 410:
+        return explicit;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @return seconds the response stays fresh from now on, <= 0 if it is stale
+ * already. without explicit expiration the lifetime is guessed as a tenth of
+ * the time since it was last modified, or DEFAULT_FRESHNESS
+ */
+long ResponseFreshness(const ResponseHead *head)
+{
+    if (head->no_cache) {
+        return 0;  // must be revalidated before every use
+    }
+
+    long lifetime;
+    if (head->s_maxage >= 0) {
+        lifetime = head->s_maxage;
+    } else if (head->max_age >= 0) {
+        lifetime = head->max_age;
+    } else if (head->expires >= 0) {
+        lifetime = head->expires - (head->date >= 0 ? head->date : time(NULL));
+    } else {
+        time_t last_modified = ParseHttpDate(head->last_modified);
+        if (last_modified >= 0 && head->date > last_modified) {
+            lifetime = (head->date - last_modified) / 10;
+            if (lifetime > MAX_HEURISTIC_FRESHNESS) {
+                lifetime = MAX_HEURISTIC_FRESHNESS;
+            }
+        } else {
+            lifetime = DEFAULT_FRESHNESS;
+        }
+    }
+    return lifetime - head->age;
+}
+
+/**
+ * @brief directives are comma separated, qualified no-cache="field" counts as
+ * plain no-cache
+ */
+static void ParseCacheControl(const char *value, ResponseHead *head)
+{
+    while (*value != '\0') {
+        value += strspn(value, " \t,");
+        if (strncasecmp(value, "no-store", 8) == 0) {
+            head->no_store = 1;
+        } else if (strncasecmp(value, "no-cache", 8) == 0) {
+            head->no_cache = 1;
+        } else if (strncasecmp(value, "private", 7) == 0) {
+            head->is_private = 1;
+        } else if (strncasecmp(value, "public", 6) == 0) {
+            head->is_public = 1;
+        } else if (strncasecmp(value, "must-revalidate", 15) == 0) {
+            head->must_revalidate = 1;
+        } else if (strncasecmp(value, "max-age=", 8) == 0) {
+            head->max_age = strtol(value + 8, NULL, 10);
+        } else if (strncasecmp(value, "s-maxage=", 9) == 0) {
+            head->s_maxage = strtol(value + 9, NULL, 10);
+        }
+
+        value += strcspn(value, ",");
+    }
+}
+
+/**
+ * @brief parse an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT", the
+ * only format servers are allowed to send
+ * @return seconds since the epoch, or -1
+ */
+static time_t ParseHttpDate(const char *value)
+{
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm tm;
+    char month[4];
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(value, " %*[A-Za-z], %d %3s %d %d:%d:%d GMT", &tm.tm_mday, month,
+               &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+        return -1;
+    }
+    const char *p = strstr(months, month);
+    if (strlen(month) != 3 || p == NULL || (p - months) % 3 != 0) {
+        return -1;
+    }
+    tm.tm_mon = (p - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/**
+ * @brief copy header value without surrounding white space into a
+ * MAX_VALIDATOR buffer, a value that does not fit is dropped
+ */
+static void CopyValue(char *dst, const char *value)
+{
+    value += strspn(value, " \t");
+    size_t len = strcspn(value, "\r\n");
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+        len--;
+    }
+
+    if (len >= MAX_VALIDATOR) {
+        len = 0;
+    }
+    memcpy(dst, value, len);
+    dst[len] = '\0';
+}
+
+/**
+ * @brief media types worth compressing, images and archives are compressed
+ * already
+ */
+static int IsTextual(const char *value)
+{
+    value += strspn(value, " \t");
+    return strncasecmp(value, "text/", 5) == 0 ||
+           strncasecmp(value, "application/json", 16) == 0 ||
+           strncasecmp(value, "application/javascript", 22) == 0 ||
+           strncasecmp(value, "application/xml", 15) == 0 ||
+           strncasecmp(value, "image/svg+xml", 13) == 0 ||
+           HasToken(value, "+json") || HasToken(value, "+xml");
+}
+
+/**
+ * @return 1 if a Vary value names anything but Accept-Encoding
+ */
+static int VariesBeyondEncoding(const char *value)
+{
+    char copy[MAXLINE];
+    snprintf(copy, MAXLINE, "%s", value);
+    char *save;
+    for (char *name = strtok_r(copy, ", \t", &save); name != NULL; name = strtok_r(NULL, ", \t", &save)) {
+        if (strcasecmp(name, "Accept-Encoding") != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* states of ChunkedScan */
+enum {
+    SCAN_SIZE,       // hex digits of a chunk size
+    SCAN_EXTENSION,  // rest of the size line
+    SCAN_DATA,       // chunk data, size bytes to go
+    SCAN_DATA_END,   // CRLF after the data
+    SCAN_TRAILER,    // trailer lines after the last chunk, size is the line's length
+    SCAN_DONE,
+};
+
+void ChunkedScanInit(ChunkedScan *scan)
+{
+    scan->state = SCAN_SIZE;
+    scan->size = 0;
+    scan->digits = 0;
+}
+
+int ChunkedScanFeed(ChunkedScan *scan, const char *data, size_t n)
+{
+    for (size_t i = 0; i < n && scan->state != SCAN_DONE; i++) {
+        char c = data[i];
+        switch (scan->state) {
+        case SCAN_SIZE:
+            if (isxdigit((unsigned char)c)) {
+                if (scan->size > ((size_t)-1 >> 4)) {
+                    return -1;
+                }
+                scan->size = scan->size * 16 + (isdigit((unsigned char)c) ? c - '0' : (c | 0x20) - 'a' + 10);
+                scan->digits++;
+                break;
+            }
+            if (scan->digits == 0) {
+                return -1;
+            }
+            scan->state = SCAN_EXTENSION;
+            /* fall through, the digits end here */
+        case SCAN_EXTENSION:
+            if (c == '\n') {
+                scan->state = scan->size > 0 ? SCAN_DATA : SCAN_TRAILER;
+            }
+            break;
+        case SCAN_DATA: {
+            size_t skip = n - i < scan->size ? n - i : scan->size;
+            scan->size -= skip;
+            i += skip - 1;
+            if (scan->size == 0) {
+                scan->state = SCAN_DATA_END;
+            }
+            break;
+        }
+        case SCAN_DATA_END:
+            if (c == '\n') {
+                scan->state = SCAN_SIZE;
+                scan->digits = 0;
+            } else if (c != '\r') {
+                return -1;
+            }
+            break;
+        case SCAN_TRAILER:
+            if (c == '\n') {
+                scan->state = scan->size == 0 ? SCAN_DONE : SCAN_TRAILER;
+                scan->size = 0;
+            } else if (c != '\r') {
+                scan->size++;
+            }
+            break;
+        }
+    }
+    return scan->state == SCAN_DONE ? 1 : 0;
+}
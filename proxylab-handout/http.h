@@ -0,0 +1,117 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdlib.h>
+#include <time.h>
+#include "parser.h"
+
+/**
+ * request helpers shared by the threaded and the event-driven proxy engines
+ */
+
+extern const char *user_agent_hdr;
+
+void ParseHostnamePath(char *url, int url_length, char *hostname, char *path, int len);
+
+int ExtractPort(char *hostname, int host_len, char *port, int port_len);
+
+int IsNeedForward(const HttpHeader *header);
+
+int IsHopByHop(const HttpHeader *header);
+
+int IsConditional(const HttpHeader *header);
+
+void ParseConnectionHeader(const HttpHeader *header, int *conn_close, int *conn_keep_alive);
+
+int AcceptsGzip(const HttpHeader *header);
+
+/*
+ * a response the proxy relays and stores carries the proxy's own Connection
+ * header right after its status line, keep-alive iff the response is framed.
+ * the stored bytes go to every client of the object, so a client that does
+ * not keep its connection is sent CLOSE_LINE in place of KEEP_ALIVE_LINE
+ */
+#define KEEP_ALIVE_LINE "Connection: keep-alive\r\n"
+#define CLOSE_LINE "Connection: close\r\n"
+
+/**
+ * @return length of the status line at the start of the n bytes of object if
+ * KEEP_ALIVE_LINE follows it, otherwise 0
+ */
+size_t KeepAliveAt(const char *object, size_t n);
+
+/**
+ * @brief write the first at bytes of object, as found by KeepAliveAt, then
+ * CLOSE_LINE. the rest of object follows from at + strlen(KEEP_ALIVE_LINE)
+ * @return bytes written, or -1
+ */
+ssize_t WriteClosingHead(int fd, const char *object, size_t at);
+
+#define MAX_VALIDATOR 128     // longer ETag / Last-Modified values are not kept
+#define DEFAULT_FRESHNESS 300  // seconds, for responses that carry no hint at all
+#define MAX_HEURISTIC_FRESHNESS 86400
+
+/*
+ * what the proxy needs to know about a response to find where it ends,
+ * whether and for how long it may be cached, and whether the cache may
+ * compress it
+ */
+typedef struct {
+    int version_minor;    // 0 for HTTP/1.0, 1 for HTTP/1.1
+    int status;
+    long content_length;  // -1 if absent
+    int chunked;          // Transfer-Encoding: chunked
+    int conn_close;       // Connection: close
+    int conn_keep_alive;  // Connection: keep-alive
+    int no_store;         // Cache-Control directives
+    int no_cache;
+    int is_private;
+    int is_public;
+    int must_revalidate;
+    long max_age;         // -1 if absent
+    long s_maxage;        // -1 if absent
+    long age;             // Age, 0 if absent
+    time_t date;          // -1 if absent
+    time_t expires;       // -1 if absent, 0 if invalid, which means already expired
+    char etag[MAX_VALIDATOR];           // "" if absent
+    char last_modified[MAX_VALIDATOR];  // "" if absent
+    int encoded;          // Content-Encoding other than identity
+    int textual;          // Content-Type is text, JSON, JavaScript or XML
+    int vary;             // Vary present
+    int vary_other;       // Vary names a header other than Accept-Encoding, or *
+    size_t head_len;      // status line and headers, set by ParseResponseBuffer only
+} ResponseHead;
+
+/* how far a chunked body has gone by, fed piece by piece to ChunkedScanFeed */
+typedef struct {
+    int state;
+    size_t size;  // of the chunk being read, or bytes of it still to come
+    int digits;   // of the size line so far
+} ChunkedScan;
+
+void ParseStatusLine(const char *line, ResponseHead *head);
+
+void ParseResponseHeader(const HttpHeader *header, ResponseHead *head);
+
+int ParseResponseBuffer(const char *buf, size_t len, ResponseHead *head);
+
+int ResponseHasBody(const ResponseHead *head);
+
+int ResponseFramed(const ResponseHead *head);
+
+int ResponseKeepAlive(const ResponseHead *head);
+
+int ResponseCacheable(const ResponseHead *head, int authorized);
+
+long ResponseFreshness(const ResponseHead *head);
+
+void ChunkedScanInit(ChunkedScan *scan);
+
+/**
+ * @brief walk the next n bytes of a chunked body
+ * @return 1 once the last chunk and the trailer went by, -1 if the body is
+ * not valid chunked encoding, 0 while more is to come
+ */
+int ChunkedScanFeed(ChunkedScan *scan, const char *data, size_t n);
+
+#endif
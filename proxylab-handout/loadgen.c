@@ -0,0 +1,510 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+#include "csapp.h"
+#include "parser.h"
+#include "stats.h"
+
+/**
+ * load generator for the proxy: closed-loop clients, each on its own thread,
+ * request objects of an origin through the proxy as fast as they are
+ * answered, for a fixed duration. the objects are files created under the
+ * origin's document root with sizes drawn from a size mix, and picked by
+ * every request from a uniform or Zipf popularity distribution.
+ *
+ * reported are throughput, latency percentiles over every request, exact as
+ * all latencies are kept, and the cache hit ratio over the run, read from
+ * the proxy's STATS_PATH before and after.
+ */
+
+#define DEFAULT_CLIENTS 16
+#define DEFAULT_DURATION 10  // seconds
+#define DEFAULT_OBJECTS 1000
+#define DEFAULT_MIX "1k:50,8k:30,64k:15,512k:5"
+#define DEFAULT_PREFIX "bench"
+#define MAX_MIX 16
+
+typedef struct {
+    size_t size;
+    double weight;
+} MixEntry;
+
+/* what one client thread did, merged by main once all are done */
+typedef struct {
+    int id;
+    unsigned long long rng;
+    int64_t *latencies;  // microseconds of every successful request
+    size_t count;
+    size_t capacity;
+    unsigned long errors;
+    unsigned long connects;
+    unsigned long long bytes;  // response bytes, heads included
+} Client;
+
+static char *g_proxy_host = "localhost";
+static char *g_proxy_port;
+static char *g_origin;          // host:port in request urls
+static char *g_prefix = DEFAULT_PREFIX;
+static int g_objects = DEFAULT_OBJECTS;
+static int g_keep_alive;
+static double *g_cdf;           // popularity of objects 0..i, NULL for uniform
+static int64_t g_deadline;      // Now when clients stop
+
+static void usage(char *prog);
+static int ParseMix(char *spec, MixEntry *mix);
+static void CreateObjects(char *dir, MixEntry *mix, int nmix);
+static void BuildZipf(double skew);
+static void *ClientThread(void *vargp);
+static int PickObject(Client *client);
+static int Fetch(Client *client, int *fd, int object);
+static int ReadResponse(int fd, unsigned long long *bytes, int *keep_alive);
+static int ReadStats(unsigned long long *hits, unsigned long long *lookups);
+static inline unsigned long long NextRandom(unsigned long long *state);
+static int64_t Now(void);
+static int CompareLatency(const void *a, const void *b);
+static void Record(Client *client, int64_t us);
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [options] <proxy port> <origin host:port>\n", prog);
+    fprintf(stderr, "  -h host   proxy host (default %s)\n", g_proxy_host);
+    fprintf(stderr, "  -c num    concurrent clients (default %d)\n", DEFAULT_CLIENTS);
+    fprintf(stderr, "  -d sec    duration (default %d)\n", DEFAULT_DURATION);
+    fprintf(stderr, "  -k        keep client connections alive, instead of one per request\n");
+    fprintf(stderr, "  -n num    distinct objects (default %d)\n", DEFAULT_OBJECTS);
+    fprintf(stderr, "  -z skew   Zipf popularity with this exponent, 0 for uniform (default 0)\n");
+    fprintf(stderr, "  -m mix    object sizes as size:weight,... (default %s)\n", DEFAULT_MIX);
+    fprintf(stderr, "  -w dir    create the objects in dir, the origin's <prefix> directory\n");
+    fprintf(stderr, "  -p prefix url path of the objects on the origin (default %s)\n", DEFAULT_PREFIX);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int nclients = DEFAULT_CLIENTS;
+    int duration = DEFAULT_DURATION;
+    double skew = 0;
+    char *mix_spec = DEFAULT_MIX;
+    char *dir = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:c:d:kn:z:m:w:p:")) != -1) {
+        switch (opt) {
+        case 'h':
+            g_proxy_host = optarg;
+            break;
+        case 'c':
+            nclients = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'k':
+            g_keep_alive = 1;
+            break;
+        case 'n':
+            g_objects = atoi(optarg);
+            break;
+        case 'z':
+            skew = atof(optarg);
+            break;
+        case 'm':
+            mix_spec = optarg;
+            break;
+        case 'w':
+            dir = optarg;
+            break;
+        case 'p':
+            g_prefix = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    MixEntry mix[MAX_MIX];
+    int nmix = ParseMix(mix_spec, mix);
+    if (optind != argc - 2 || nclients < 1 || duration < 1 || g_objects < 1 || skew < 0 || nmix <= 0) {
+        usage(argv[0]);
+    }
+    g_proxy_port = argv[optind];
+    g_origin = argv[optind + 1];
+
+    Signal(SIGPIPE, SIG_IGN);
+    if (dir != NULL) {
+        CreateObjects(dir, mix, nmix);
+    }
+    if (skew > 0) {
+        BuildZipf(skew);
+    }
+
+    unsigned long long hits0, lookups0;
+    int have_stats = ReadStats(&hits0, &lookups0) == 0;
+
+    Client *clients = (Client *)Calloc(nclients, sizeof(Client));
+    pthread_t *tids = (pthread_t *)Malloc(nclients * sizeof(pthread_t));
+    int64_t start = Now();
+    g_deadline = start + (int64_t)duration * 1000000;
+    for (int i = 0; i < nclients; i++) {
+        clients[i].id = i;
+        clients[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1) ^ start;
+        Pthread_create(&tids[i], NULL, ClientThread, &clients[i]);
+    }
+
+    size_t total = 0;
+    unsigned long errors = 0;
+    unsigned long connects = 0;
+    unsigned long long bytes = 0;
+    for (int i = 0; i < nclients; i++) {
+        Pthread_join(tids[i], NULL);
+        total += clients[i].count;
+        errors += clients[i].errors;
+        connects += clients[i].connects;
+        bytes += clients[i].bytes;
+    }
+    double elapsed = (Now() - start) / 1e6;
+
+    int64_t *all = (int64_t *)Malloc((total > 0 ? total : 1) * sizeof(int64_t));
+    size_t n = 0;
+    for (int i = 0; i < nclients; i++) {
+        memcpy(all + n, clients[i].latencies, clients[i].count * sizeof(int64_t));
+        n += clients[i].count;
+        Free(clients[i].latencies);
+    }
+    qsort(all, total, sizeof(int64_t), CompareLatency);
+
+    printf("clients %d %s, objects %d %s, mix %s\n", nclients, g_keep_alive ? "keep-alive" : "close",
+           g_objects, skew > 0 ? "zipf" : "uniform", mix_spec);
+    printf("requests %zu errors %lu connections %lu in %.2f s\n", total, errors, connects, elapsed);
+    printf("throughput %.1f req/s %.2f MB/s\n", total / elapsed, bytes / elapsed / (1 << 20));
+    if (total > 0) {
+        printf("latency_us p50=%lld p99=%lld p999=%lld max=%lld\n",
+               (long long)all[(size_t)(total * 0.50)], (long long)all[(size_t)(total * 0.99)],
+               (long long)all[(size_t)(total * 0.999)], (long long)all[total - 1]);
+    }
+    unsigned long long hits1, lookups1;
+    if (have_stats && ReadStats(&hits1, &lookups1) == 0 && lookups1 > lookups0) {
+        printf("hit_ratio %.4f\n", (double)(hits1 - hits0) / (lookups1 - lookups0));
+    } else {
+        printf("hit_ratio n/a (%s not readable)\n", STATS_PATH);
+    }
+
+    Free(all);
+    Free(tids);
+    Free(clients);
+    return errors > 0 && total == 0;
+}
+
+/**
+ * @brief "1k:50,64k:10", sizes in bytes with an optional k or m suffix
+ * @return number of entries, or -1 if malformed
+ */
+static int ParseMix(char *spec, MixEntry *mix)
+{
+    int n = 0;
+    char *p = spec;
+    while (*p != '\0') {
+        char *end;
+        double size = strtod(p, &end);
+        if (*end == 'k' || *end == 'K') {
+            size *= 1024;
+            end++;
+        } else if (*end == 'm' || *end == 'M') {
+            size *= 1024 * 1024;
+            end++;
+        }
+        if (end == p || *end != ':' || n == MAX_MIX || size < 1) {
+            return -1;
+        }
+        p = end + 1;
+        mix[n].size = size;
+        mix[n].weight = strtod(p, &end);
+        if (end == p || mix[n].weight <= 0 || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        n++;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+/**
+ * @brief write every object with a size drawn from mix. the bytes are random
+ * and the names end in .jpg, so the proxy does not spend time trying to
+ * compress what will not compress
+ */
+static void CreateObjects(char *dir, MixEntry *mix, int nmix)
+{
+    double total = 0;
+    for (int i = 0; i < nmix; i++) {
+        total += mix[i].weight;
+    }
+    mkdir(dir, 0755);
+
+    unsigned long long rng = 42;  // same sizes on every run
+    char *data = NULL;
+    size_t data_len = 0;
+    for (int object = 0; object < g_objects; object++) {
+        double r = (NextRandom(&rng) >> 11) * 0x1.0p-53 * total;
+        int i = 0;
+        while (i < nmix - 1 && (r -= mix[i].weight) >= 0) {
+            i++;
+        }
+        size_t size = mix[i].size;
+        if (size > data_len) {
+            data = (char *)Realloc(data, size);
+            for (size_t j = data_len; j < size; j++) {
+                data[j] = NextRandom(&rng) >> 56;
+            }
+            data_len = size;
+        }
+
+        char path[MAXLINE];
+        snprintf(path, MAXLINE, "%s/obj-%d.jpg", dir, object);
+        int fd = Open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        Rio_writen(fd, data, size);
+        Close(fd);
+    }
+    Free(data);
+}
+
+/**
+ * @brief cumulative popularity of the objects, object i weighs 1 / (i + 1)^skew
+ */
+static void BuildZipf(double skew)
+{
+    g_cdf = (double *)Malloc(g_objects * sizeof(double));
+    double sum = 0;
+    for (int i = 0; i < g_objects; i++) {
+        sum += 1 / pow(i + 1, skew);
+        g_cdf[i] = sum;
+    }
+    for (int i = 0; i < g_objects; i++) {
+        g_cdf[i] /= sum;
+    }
+}
+
+static void *ClientThread(void *vargp)
+{
+    Client *client = (Client *)vargp;
+    int fd = -1;
+    while (Now() < g_deadline) {
+        int object = PickObject(client);
+        int64_t start = Now();
+        if (Fetch(client, &fd, object) < 0) {
+            client->errors++;
+            continue;
+        }
+        Record(client, Now() - start);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+static int PickObject(Client *client)
+{
+    double r = (NextRandom(&client->rng) >> 11) * 0x1.0p-53;
+    if (g_cdf == NULL) {
+        return r * g_objects;
+    }
+    int lo = 0;
+    int hi = g_objects - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (g_cdf[mid] < r) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * @brief request object through the proxy on *fd, connecting first if there
+ * is no connection. a kept-alive connection the proxy closed meanwhile is
+ * replaced once
+ * @return 0 for a whole 200 response, or -1
+ */
+static int Fetch(Client *client, int *fd, int object)
+{
+    char request[MAXLINE];
+    int len = snprintf(request, MAXLINE,
+                       "GET http://%s/%s/obj-%d.jpg HTTP/1.1\r\nHost: %s\r\n"
+                       "Connection: %s\r\n\r\n",
+                       g_origin, g_prefix, object, g_origin, g_keep_alive ? "keep-alive" : "close");
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused = *fd >= 0;
+        if (!reused) {
+            if ((*fd = open_clientfd(g_proxy_host, g_proxy_port)) < 0) {
+                return -1;
+            }
+            client->connects++;
+        }
+
+        int keep_alive = 0;
+        int status = -1;
+        if (rio_writen(*fd, request, len) == len) {
+            status = ReadResponse(*fd, &client->bytes, &keep_alive);
+        }
+        if (status < 0 || !keep_alive || !g_keep_alive) {
+            close(*fd);
+            *fd = -1;
+        }
+        if (status >= 0) {
+            return status == 200 ? 0 : -1;
+        }
+        if (!reused) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief read a whole response, framed by Content-Length or the end of the
+ * connection
+ * @param keep_alive[out] 1 if the connection can carry another request
+ * @return status code, or -1 if the response was cut short or malformed
+ */
+static int ReadResponse(int fd, unsigned long long *bytes, int *keep_alive)
+{
+    char buf[MAXBUF];
+    size_t len = 0;
+    HttpParser parser;
+    HttpParserInit(&parser, 1);
+    int rc;
+    while ((rc = HttpParse(&parser, buf, len)) == HTTP_PARTIAL) {
+        if (len == MAXBUF) {
+            return -1;
+        }
+        ssize_t n = read(fd, buf + len, MAXBUF - len);
+        if (n <= 0) {
+            return -1;
+        }
+        len += n;
+    }
+    if (rc == HTTP_ERROR) {
+        return -1;
+    }
+
+    long content_length = -1;
+    int conn_close = 0;
+    int conn_keep_alive = 0;
+    for (int i = 0; i < parser.nheaders; i++) {
+        HttpHeader *header = &parser.headers[i];
+        if (header->id == HDR_CONTENT_LENGTH) {
+            char value[32];
+            content_length = atol(SliceCopy(header->value, value, sizeof(value)));
+        } else if (header->id == HDR_CONNECTION || header->id == HDR_PROXY_CONNECTION) {
+            conn_close = conn_close || SliceCaseEqual(header->value, "close");
+            conn_keep_alive = conn_keep_alive || SliceCaseEqual(header->value, "keep-alive");
+        }
+    }
+    *keep_alive = content_length >= 0 &&
+                  (parser.version_minor >= 1 ? !conn_close : conn_keep_alive);
+
+    /* body bytes that came with the head, then the rest */
+    size_t body = len - parser.off;
+    *bytes += len;
+    while (content_length < 0 || body < (size_t)content_length) {
+        size_t want = content_length < 0 ? MAXBUF : content_length - body;
+        ssize_t n = read(fd, buf, want < MAXBUF ? want : MAXBUF);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            return content_length < 0 ? parser.status : -1;
+        }
+        body += n;
+        *bytes += n;
+    }
+    return parser.status;
+}
+
+/**
+ * @brief read the proxy's hit and lookup counts from STATS_PATH
+ * @return 0, or -1 if the proxy does not answer with them
+ */
+static int ReadStats(unsigned long long *hits, unsigned long long *lookups)
+{
+    int fd = open_clientfd(g_proxy_host, g_proxy_port);
+    if (fd < 0) {
+        return -1;
+    }
+    char request[] = "GET " STATS_PATH " HTTP/1.0\r\n\r\n";
+    rio_t rio;
+    char line[MAXLINE];
+    Rio_readinitb(&rio, fd);
+    if (rio_writen(fd, request, sizeof(request) - 1) < 0 ||
+        rio_readlineb(&rio, line, MAXLINE) <= 0 || strstr(line, " 200 ") == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    static const char *hit_names[] = {"hit", "disk_hit"};
+    static const char *lookup_names[] = {"hit", "disk_hit", "miss", "revalidated", "coalesced"};
+    *hits = 0;
+    *lookups = 0;
+    while (rio_readlineb(&rio, line, MAXLINE) > 0) {
+        char name[MAXLINE];
+        unsigned long long value;
+        if (sscanf(line, "%s %llu", name, &value) != 2) {
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(hit_names) / sizeof(hit_names[0]); i++) {
+            if (strcmp(name, hit_names[i]) == 0) {
+                *hits += value;
+            }
+        }
+        for (size_t i = 0; i < sizeof(lookup_names) / sizeof(lookup_names[0]); i++) {
+            if (strcmp(name, lookup_names[i]) == 0) {
+                *lookups += value;
+            }
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * @brief xorshift64*
+ */
+static inline unsigned long long NextRandom(unsigned long long *state)
+{
+    unsigned long long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * @return microseconds on the monotonic clock
+ */
+static int64_t Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int CompareLatency(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void Record(Client *client, int64_t us)
+{
+    if (client->count == client->capacity) {
+        client->capacity = client->capacity ? 2 * client->capacity : 4096;
+        client->latencies = (int64_t *)Realloc(client->latencies, client->capacity * sizeof(int64_t));
+    }
+    client->latencies[client->count++] = us;
+}
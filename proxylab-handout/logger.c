@@ -0,0 +1,143 @@
+#include "csapp.h"
+#include "logger.h"
+#include "stats.h"
+
+typedef struct {
+    uint64_t seq;  // pos when free for the producer of pos, pos + 1 once filled
+    size_t len;
+    char line[LOG_LINE];
+} LogSlot;
+
+static LogSlot g_ring[LOG_SLOTS];
+static uint64_t g_head;  // next position to claim, producers only
+static uint64_t g_tail;  // next position to write out, under g_drain_mutex
+static pthread_mutex_t g_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_started;
+
+static int Drain(void);
+static void *WriterThread(void *vargp);
+
+void LogInit(void)
+{
+    for (uint64_t i = 0; i < LOG_SLOTS; i++) {
+        g_ring[i].seq = i;
+    }
+    __atomic_store_n(&g_started, 1, __ATOMIC_RELEASE);
+
+    pthread_t tid;
+    Pthread_create(&tid, NULL, WriterThread, NULL);
+    Pthread_detach(tid);
+}
+
+void LogPrintf(const char *fmt, ...)
+{
+    va_list ap;
+    if (!__atomic_load_n(&g_started, __ATOMIC_ACQUIRE)) {
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+        fflush(stdout);
+        return;
+    }
+
+    uint64_t pos = __atomic_load_n(&g_head, __ATOMIC_RELAXED);
+    LogSlot *slot;
+    while (1) {
+        slot = &g_ring[pos & (LOG_SLOTS - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&g_head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            StatsAdd(STAT_LOG_DROPPED, 1);  // writer is a whole ring behind
+            return;
+        } else {
+            pos = __atomic_load_n(&g_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    va_start(ap, fmt);
+    int len = vsnprintf(slot->line, LOG_LINE, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        len = 0;
+    } else if (len >= LOG_LINE) {
+        len = LOG_LINE - 1;
+        slot->line[len - 1] = '\n';
+    }
+    slot->len = len;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void LogChain(const char *prefix, const Chain *chain)
+{
+    char line[LOG_LINE];
+    size_t len = 0;
+    for (Chunk *chunk = chain->head; chunk != NULL; chunk = chunk->next) {
+        for (size_t i = 0; i < chunk->len; i++) {
+            char c = chunk->data[i];
+            if (c != '\n' && len < sizeof(line)) {
+                line[len++] = c;
+            } else if (c == '\n') {
+                LogPrintf("%s %.*s\n", prefix, (int)len, line);
+                len = 0;
+            }
+        }
+    }
+    if (len > 0) {
+        LogPrintf("%s %.*s\n", prefix, (int)len, line);
+    }
+}
+
+void LogFlush(void)
+{
+    if (!__atomic_load_n(&g_started, __ATOMIC_ACQUIRE)) {
+        fflush(stdout);
+        return;
+    }
+    while (Drain() > 0) {
+    }
+}
+
+/**
+ * @brief write the filled slots at the tail to stdout in one batch
+ * @return number of lines written
+ */
+static int Drain(void)
+{
+    char batch[LOG_SLOTS / 16 * LOG_LINE];
+    size_t len = 0;
+    int lines = 0;
+
+    pthread_mutex_lock(&g_drain_mutex);
+    while (len + LOG_LINE <= sizeof(batch)) {
+        LogSlot *slot = &g_ring[g_tail & (LOG_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != g_tail + 1) {
+            break;  // not yet filled in
+        }
+        memcpy(batch + len, slot->line, slot->len);
+        len += slot->len;
+        __atomic_store_n(&slot->seq, g_tail + LOG_SLOTS, __ATOMIC_RELEASE);
+        g_tail++;
+        lines++;
+    }
+    /* under the mutex, so batches reach stdout in ring order */
+    if (len > 0 && rio_writen(STDOUT_FILENO, batch, len) < 0) {
+        lines = 0;  // stdout is gone, nothing more to do
+    }
+    pthread_mutex_unlock(&g_drain_mutex);
+    return lines;
+}
+
+static void *WriterThread(void *vargp)
+{
+    struct timespec idle = {0, LOG_IDLE_MS * 1000000L};
+    while (1) {
+        if (Drain() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include "chunk.h"
+
+/**
+ * asynchronous logger. request threads format a line into a slot of a
+ * bounded ring and go on, a writer thread of its own drains the ring to
+ * stdout in batches, so a slow terminal or pipe never stalls a request and
+ * lines of different threads are never interleaved. producers claim slots
+ * with a compare-and-swap on the head and publish them through a sequence
+ * number per slot, as in Vyukov's bounded queue; when the ring is full the
+ * line is dropped and counted in STAT_LOG_DROPPED rather than waited for.
+ */
+
+#define LOG_SLOTS 4096   // power of 2
+#define LOG_LINE 256     // longer lines are cut
+#define LOG_IDLE_MS 10   // writer sleep when the ring is empty
+
+/**
+ * @brief start the writer thread, lines logged before are written directly
+ */
+void LogInit(void);
+
+void LogPrintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * @brief log every line of chain, each behind prefix
+ */
+void LogChain(const char *prefix, const Chain *chain);
+
+/**
+ * @brief write out everything logged so far, before the process exits
+ */
+void LogFlush(void);
+
+#endif
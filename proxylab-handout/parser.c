@@ -0,0 +1,225 @@
+#include <string.h>
+#include <strings.h>
+#include "parser.h"
+
+#define NAME(s) s, sizeof(s) - 1
+
+/*
+ * names by HeaderHash, which has no collisions among them. a name that hashes
+ * to an empty slot or to another name is HDR_OTHER
+ */
+static const struct {
+    const char *name;
+    size_t len;
+    HeaderId id;
+} g_header_table[64] = {
+    [0] = {NAME("If-Range"), HDR_IF_RANGE},
+    [2] = {NAME("Cache-Control"), HDR_CACHE_CONTROL},
+    [8] = {NAME("Keep-Alive"), HDR_KEEP_ALIVE},
+    [9] = {NAME("If-Modified-Since"), HDR_IF_MODIFIED_SINCE},
+    [11] = {NAME("If-Unmodified-Since"), HDR_IF_UNMODIFIED_SINCE},
+    [16] = {NAME("Host"), HDR_HOST},
+    [17] = {NAME("Expires"), HDR_EXPIRES},
+    [21] = {NAME("Last-Modified"), HDR_LAST_MODIFIED},
+    [23] = {NAME("Vary"), HDR_VARY},
+    [24] = {NAME("Range"), HDR_RANGE},
+    [28] = {NAME("Transfer-Encoding"), HDR_TRANSFER_ENCODING},
+    [30] = {NAME("Proxy-Connection"), HDR_PROXY_CONNECTION},
+    [31] = {NAME("Content-Length"), HDR_CONTENT_LENGTH},
+    [33] = {NAME("Accept-Encoding"), HDR_ACCEPT_ENCODING},
+    [34] = {NAME("ETag"), HDR_ETAG},
+    [35] = {NAME("Age"), HDR_AGE},
+    [40] = {NAME("Content-Encoding"), HDR_CONTENT_ENCODING},
+    [43] = {NAME("If-Match"), HDR_IF_MATCH},
+    [44] = {NAME("Cookie"), HDR_COOKIE},
+    [45] = {NAME("Date"), HDR_DATE},
+    [46] = {NAME("Authorization"), HDR_AUTHORIZATION},
+    [48] = {NAME("If-None-Match"), HDR_IF_NONE_MATCH},
+    [49] = {NAME("Connection"), HDR_CONNECTION},
+    [50] = {NAME("Content-Type"), HDR_CONTENT_TYPE},
+    [61] = {NAME("User-Agent"), HDR_USER_AGENT},
+};
+
+static int ParseStartLine(HttpParser *parser, const char *line, size_t len);
+static int ParseVersion(const char *p, size_t len, int *minor);
+static Slice NextToken(const char **p, const char *end);
+static unsigned HeaderHash(const char *name, size_t len);
+
+void HttpParserInit(HttpParser *parser, int response)
+{
+    parser->response = response;
+    parser->state = PARSE_START_LINE;
+    parser->off = 0;
+    parser->scanned = 0;
+    parser->version_minor = 0;
+    parser->status = 0;
+    parser->nheaders = 0;
+}
+
+int HttpParse(HttpParser *parser, const char *buf, size_t len)
+{
+    while (parser->state != PARSE_DONE) {
+        const char *line = buf + parser->off;
+        const char *eol = memchr(buf + parser->scanned, '\n', len - parser->scanned);
+        if (eol == NULL) {
+            parser->scanned = len;  // the part of the line seen is not searched again
+            return HTTP_PARTIAL;
+        }
+        size_t line_len = eol + 1 - line;
+        size_t text_len = line_len - 1 - (eol > line && eol[-1] == '\r');
+        parser->off += line_len;
+        parser->scanned = parser->off;
+
+        if (parser->state == PARSE_START_LINE) {
+            if (text_len == 0 && !parser->response) {
+                continue;  // empty lines before a request line are ignored
+            }
+            if (ParseStartLine(parser, line, text_len) < 0) {
+                return HTTP_ERROR;
+            }
+            parser->state = PARSE_HEADERS;
+        } else if (text_len == 0) {
+            parser->state = PARSE_DONE;
+        } else if (parser->nheaders == HTTP_MAX_HEADERS ||
+                   !HttpParseHeader(line, line_len, &parser->headers[parser->nheaders])) {
+            return HTTP_ERROR;
+        } else {
+            parser->nheaders++;
+        }
+    }
+    return HTTP_DONE;
+}
+
+int HttpParseHeader(const char *line, size_t len, HttpHeader *header)
+{
+    const char *colon = memchr(line, ':', len);
+    if (colon == NULL || colon == line) {
+        return 0;
+    }
+    /* no white space in or after the name, which also rules out folded lines */
+    for (const char *p = line; p < colon; p++) {
+        if (*p == ' ' || *p == '\t') {
+            return 0;
+        }
+    }
+
+    const char *value = colon + 1;
+    const char *end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')) {
+        end--;
+    }
+
+    header->name.data = line;
+    header->name.len = colon - line;
+    header->value.data = value;
+    header->value.len = end - value;
+    header->line.data = line;
+    header->line.len = len;
+    header->id = HttpHeaderId(line, colon - line);
+    return 1;
+}
+
+HeaderId HttpHeaderId(const char *name, size_t len)
+{
+    if (len == 0) {
+        return HDR_OTHER;
+    }
+    unsigned h = HeaderHash(name, len);
+    if (g_header_table[h].len == len && strncasecmp(g_header_table[h].name, name, len) == 0) {
+        return g_header_table[h].id;
+    }
+    return HDR_OTHER;
+}
+
+int SliceCaseEqual(Slice slice, const char *str)
+{
+    return strlen(str) == slice.len && strncasecmp(slice.data, str, slice.len) == 0;
+}
+
+char *SliceCopy(Slice slice, char *dst, size_t size)
+{
+    size_t len = slice.len < size - 1 ? slice.len : size - 1;
+    memcpy(dst, slice.data, len);
+    dst[len] = '\0';
+    return dst;
+}
+
+/**
+ * @brief "GET /index.html HTTP/1.1" or "HTTP/1.1 200 OK", without line end
+ * @return 0, or -1 if malformed
+ */
+static int ParseStartLine(HttpParser *parser, const char *line, size_t len)
+{
+    const char *p = line;
+    const char *end = line + len;
+
+    if (!parser->response) {
+        parser->method = NextToken(&p, end);
+        parser->target = NextToken(&p, end);
+        Slice version = NextToken(&p, end);
+        if (parser->method.len == 0 || parser->target.len == 0 || p != end) {
+            return -1;
+        }
+        return ParseVersion(version.data, version.len, &parser->version_minor);
+    }
+
+    Slice version = NextToken(&p, end);
+    Slice status = NextToken(&p, end);
+    if (ParseVersion(version.data, version.len, &parser->version_minor) < 0 || status.len != 3) {
+        return -1;
+    }
+    parser->status = 0;
+    for (size_t i = 0; i < 3; i++) {
+        if (status.data[i] < '0' || status.data[i] > '9') {
+            return -1;
+        }
+        parser->status = parser->status * 10 + status.data[i] - '0';
+    }
+    parser->reason.data = p;
+    parser->reason.len = end - p;
+    return 0;
+}
+
+/**
+ * @brief only HTTP/1.x is spoken
+ */
+static int ParseVersion(const char *p, size_t len, int *minor)
+{
+    if (len != 8 || strncmp(p, "HTTP/1.", 7) != 0 || p[7] < '0' || p[7] > '9') {
+        return -1;
+    }
+    *minor = p[7] - '0';
+    return 0;
+}
+
+/**
+ * @brief the run of non-space bytes at *p, *p moves past it and the spaces
+ * that follow
+ */
+static Slice NextToken(const char **p, const char *end)
+{
+    Slice token;
+    token.data = *p;
+    while (*p < end && **p != ' ') {
+        (*p)++;
+    }
+    token.len = *p - token.data;
+    while (*p < end && **p == ' ') {
+        (*p)++;
+    }
+    return token;
+}
+
+/**
+ * @brief length, first and last byte, folded to lower case, are enough to tell
+ * the names of g_header_table apart
+ */
+static unsigned HeaderHash(const char *name, size_t len)
+{
+    unsigned first = (unsigned char)name[0] | 0x20;
+    unsigned last = (unsigned char)name[len - 1] | 0x20;
+    return (len + 3 * first + 57 * last) & 63;
+}
@@ -0,0 +1,117 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stddef.h>
+
+/**
+ * incremental HTTP/1.x message head parser, shared by the proxy and tiny.
+ * it tokenizes in place: the start line and the headers come out as slices
+ * pointing into the caller's receive buffer, nothing is copied. the caller
+ * appends what it reads to the buffer and calls HttpParse again, only whole
+ * lines are consumed, so a head cut anywhere by a short read is picked up
+ * where the previous call stopped. the buffer must not move while the parser
+ * or its slices are in use.
+ *
+ * header names are classified while parsing by a perfect hash over the names
+ * the proxy acts on, users switch on HeaderId instead of comparing strings.
+ */
+
+#define HTTP_MAX_HEADERS 100  // a head with more is rejected
+
+/* results of HttpParse */
+#define HTTP_ERROR -1    // malformed, answer 400
+#define HTTP_PARTIAL 0   // head goes on, read more into the buffer
+#define HTTP_DONE 1      // whole head parsed, off is its length
+
+typedef struct {
+    const char *data;
+    size_t len;
+} Slice;
+
+typedef enum {
+    HDR_OTHER = 0,  // not one the proxy acts on
+    HDR_HOST,
+    HDR_USER_AGENT,
+    HDR_CONNECTION,
+    HDR_PROXY_CONNECTION,
+    HDR_KEEP_ALIVE,
+    HDR_ACCEPT_ENCODING,
+    HDR_IF_MATCH,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_IF_UNMODIFIED_SINCE,
+    HDR_IF_RANGE,
+    HDR_CONTENT_LENGTH,
+    HDR_TRANSFER_ENCODING,
+    HDR_CACHE_CONTROL,
+    HDR_EXPIRES,
+    HDR_DATE,
+    HDR_AGE,
+    HDR_ETAG,
+    HDR_LAST_MODIFIED,
+    HDR_CONTENT_ENCODING,
+    HDR_CONTENT_TYPE,
+    HDR_VARY,
+    HDR_AUTHORIZATION,
+    HDR_RANGE,
+    HDR_COOKIE,
+} HeaderId;
+
+typedef struct {
+    HeaderId id;
+    Slice name;
+    Slice value;  // without surrounding white space
+    Slice line;   // whole line with its line end, to pass it on as is
+} HttpHeader;
+
+typedef enum {
+    PARSE_START_LINE,
+    PARSE_HEADERS,
+    PARSE_DONE,
+} ParseState;
+
+typedef struct {
+    int response;      // head starts with a status line, not a request line
+    ParseState state;
+    size_t off;        // bytes of the buffer consumed, whole lines only
+    size_t scanned;    // bytes of the buffer searched for the next line end
+    Slice method;      // request line
+    Slice target;
+    int version_minor; // 0 for HTTP/1.0, 1 for HTTP/1.1
+    int status;        // status line
+    Slice reason;
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    int nheaders;
+} HttpParser;
+
+/**
+ * @param response 1 to parse a response head, 0 for a request head
+ */
+void HttpParserInit(HttpParser *parser, int response);
+
+/**
+ * @brief parse on from parser->off, buf holds everything received so far
+ * @return HTTP_DONE, HTTP_PARTIAL or HTTP_ERROR
+ */
+int HttpParse(HttpParser *parser, const char *buf, size_t len);
+
+/**
+ * @brief tokenize one header line, len includes its line end
+ * @return 1, or 0 if line is not a header
+ */
+int HttpParseHeader(const char *line, size_t len, HttpHeader *header);
+
+HeaderId HttpHeaderId(const char *name, size_t len);
+
+/**
+ * @return 1 if slice is str, ignoring case
+ */
+int SliceCaseEqual(Slice slice, const char *str);
+
+/**
+ * @brief copy slice into dst as a string, cut to size - 1 bytes
+ * @return dst
+ */
+char *SliceCopy(Slice slice, char *dst, size_t size);
+
+#endif
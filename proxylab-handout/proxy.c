@@ -2,309 +2,1172 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <poll.h>
 #include "csapp.h"
 #include "cache.h"
+#include "sbuf.h"
+#include "http.h"
+#include "event.h"
+#include "relay.h"
+#include "upstream.h"
+#include "dns.h"
+#include "flight.h"
+#include "disk.h"
+#include "stats.h"
+#include "logger.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+#define DEFAULT_THREADS 16
+#define DEFAULT_QUEUE_DEPTH 128
+#define DEFAULT_CLIENT_TIMEOUT 15
 
+/* origin failed before a whole response head, see ProxyRespondClient */
+#define ORIGIN_SILENT -1   // closed or reset, answer 502
+#define ORIGIN_TIMEOUT -2  // timed out, answer 504
 
-/* You won't lose style points for including this long line in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static void test_ParseHostnamePath();
 static void test_ExtractPort();
 
-void ProcessTask(void *context);
+static sbuf_t g_connfds;  // connected descriptors waiting for a worker
+
+void *ProcessTask(void *context);
 void DealWithProxyRequest(int connfd);
 
+static int g_client_timeout = DEFAULT_CLIENT_TIMEOUT;  // seconds a client may stay idle
+
+static char *g_snapshot_path;  // cache snapshot, NULL if not kept
+static int g_snapshot_period;  // seconds between snapshots, 0 for only on exit
+static sigset_t g_exit_signals;  // taken by SnapshotThread, blocked everywhere else
+
+/* bytes received from a client, request heads are parsed in place */
+typedef struct {
+    int fd;           // connection between client and proxy
+    char buf[MAXBUF];
+    size_t len;       // bytes received and not consumed by a request yet
+} ClientBuf;
+
+/* state of relaying one origin response to the client */
+typedef struct {
+    rio_t rio;      // buffered reader over the origin connection
+    int connfd;     // connection between client and proxy
+    Flight *flight; // response is kept in flight->object for followers and the cache
+    int keep;       // bytes still go to flight->object
+    int client_ok;  // client still takes bytes, the fetch goes on for the others if not
+    time_t deadline; // end of g_timeouts.total, 0 for none
+} Relay;
+
+static void StartSnapshots(void);
+static void *SnapshotThread(void *vargp);
+static void WriteSnapshot(void);
 static void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
-static void ParseHostnamePath(char *url, int url_length, char *hostname, char *path, int len);
-static int ExtractPort(char *hostname, int host_len, char *port, int port_len);
-static void ProxyRequestServer(rio_t *rio, int client_fd, char *hostname, size_t host_len, char *path, size_t path_len);
-static void ProxyRespondClient(int connfd, int client_fd, char *url, size_t url_len);
-static int IsNeedForward(const char *request_header, size_t header_len);
-static inline void SendClientCache(int connfd, char *cache_object, size_t object_len);
+static int WaitForRequest(ClientBuf *client);
+static int ServeProxyRequest(ClientBuf *client);
+static int ReadRequest(ClientBuf *client, HttpParser *parser);
+static int ServeParsedRequest(int connfd, HttpParser *parser, RequestTrace *trace);
+static int ServeAdmin(int connfd);
+static int ServeTunnel(ClientBuf *client, HttpParser *parser, RequestTrace *trace);
+static void PumpTunnel(int connfd, int server_fd);
+static void UpstreamError(int connfd, char *hostname, int rc);
+static int ServeCached(int connfd, Entry *entry, int keep_alive, int gzip, RequestTrace *trace);
+static int ServeDisk(int connfd, DiskRef *ref, int keep_alive, RequestTrace *trace);
+static int FetchFromOrigin(int connfd, char *url, char *hostname, char *path, struct iovec *headers, int nheaders, Flight *flight, Entry *stale, int keep_alive, int authorized, RequestTrace *trace);
+static int ProxyRequestServer(int client_fd, char *hostname, size_t host_len, char *path, size_t path_len, struct iovec *headers, int nheaders, Entry *stale);
+static int ProxyRespondClient(int connfd, int client_fd, char *url, size_t url_len, Flight *flight, Entry *stale, int keep_alive, int authorized, int *delivered, RequestTrace *trace);
+static inline int SendClientCache(int connfd, Chain *cache_object, int keep_alive, RequestTrace *trace);
+static inline int PushIov(struct iovec *iov, int iovcnt, char *base, size_t len);
+static void StopCaching(Relay *relay);
+static int SendToClient(Relay *relay, char *data, size_t n);
+static int RelayBytes(Relay *relay, char *data, size_t n);
+static int RelayBody(Relay *relay, size_t n);
+static int RelayChunked(Relay *relay);
+static int Expired(Relay *relay);
+static int OriginFailure(ssize_t rc);
 
 
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [options] <port>\n", prog);
+    fprintf(stderr, "  -e        serve connections from epoll event loops instead of a thread pool\n");
+    fprintf(stderr, "  -r num    event loops for -e (default: online CPUs)\n");
+    fprintf(stderr, "  -t num    worker threads (default %d)\n", DEFAULT_THREADS);
+    fprintf(stderr, "  -q num    connections queued for workers (default %d)\n", DEFAULT_QUEUE_DEPTH);
+    fprintf(stderr, "  -s num    cache shards (default %d, with -e one per event loop)\n", DEFAULT_SHARDS);
+    fprintf(stderr, "  -k sec    keep idle origin connections for reuse (default %d, 0 disables)\n", DEFAULT_IDLE_TIMEOUT);
+    fprintf(stderr, "  -i sec    close client connections idle for this long (default %d)\n", DEFAULT_CLIENT_TIMEOUT);
+    fprintf(stderr, "  -c sec    origin connect timeout (default %d)\n", DEFAULT_CONNECT_TIMEOUT);
+    fprintf(stderr, "  -R sec    read timeout, origins and clients (default %d)\n", DEFAULT_IO_TIMEOUT);
+    fprintf(stderr, "  -W sec    write timeout, origins and clients (default %d)\n", DEFAULT_IO_TIMEOUT);
+    fprintf(stderr, "  -L sec    limit on the time of a whole response (default %d)\n", DEFAULT_TOTAL_TIMEOUT);
+    fprintf(stderr, "  -U sec    close CONNECT tunnels idle both ways for this long (default %d)\n", DEFAULT_TUNNEL_TIMEOUT);
+    fprintf(stderr, "  -C ports  comma separated ports CONNECT may tunnel to, * for any (default %d)\n", DEFAULT_TUNNEL_PORT);
+    fprintf(stderr, "  -m num    connections in use per origin, 0 for no cap (default %d)\n", DEFAULT_MAX_PER_ORIGIN);
+    fprintf(stderr, "  -H file   hosts file resolving names without DNS\n");
+    fprintf(stderr, "  -d dir    keep objects evicted from memory in segment files under dir\n");
+    fprintf(stderr, "  -D MB     disk cache capacity for -d (default %d)\n", DISK_DEFAULT_CAPACITY);
+    fprintf(stderr, "  -E policy cache eviction policy: lru, or gdsf to favour small objects (default %s)\n", DEFAULT_POLICY);
+    fprintf(stderr, "  -S file   load the cache from file at startup, save it there on SIGINT/SIGTERM\n");
+    fprintf(stderr, "  -P sec    also save the cache every sec seconds for -S\n");
+    fprintf(stderr, "  -T sec    log the %s report every sec seconds\n", STATS_PATH);
+    exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+    int nthreads = DEFAULT_THREADS;
+    int queue_depth = DEFAULT_QUEUE_DEPTH;
+    int nshards = 0;
+    int use_epoll = 0;
+    int nreactors = sysconf(_SC_NPROCESSORS_ONLN);
+    int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    int max_per_origin = DEFAULT_MAX_PER_ORIGIN;
+    char *hosts_file = NULL;
+    char *disk_dir = NULL;
+    int disk_capacity = DISK_DEFAULT_CAPACITY;
+    const EvictionPolicy *policy = CachePolicy(DEFAULT_POLICY);
+    int stats_period = 0;
+    int tunnel_ports = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "er:t:q:s:k:i:c:R:W:L:U:C:m:H:d:D:E:S:P:T:")) != -1) {
+        switch (opt) {
+        case 'e':
+            use_epoll = 1;
+            break;
+        case 'r':
+            nreactors = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'q':
+            queue_depth = atoi(optarg);
+            break;
+        case 's':
+            nshards = atoi(optarg);
+            break;
+        case 'k':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'i':
+            g_client_timeout = atoi(optarg);
+            break;
+        case 'c':
+            g_timeouts.connect = atoi(optarg);
+            break;
+        case 'R':
+            g_timeouts.read = atoi(optarg);
+            break;
+        case 'W':
+            g_timeouts.write = atoi(optarg);
+            break;
+        case 'L':
+            g_timeouts.total = atoi(optarg);
+            break;
+        case 'U':
+            g_timeouts.tunnel = atoi(optarg);
+            break;
+        case 'C':
+            tunnel_ports = UpstreamTunnelPorts(optarg);
+            break;
+        case 'm':
+            max_per_origin = atoi(optarg);
+            break;
+        case 'H':
+            hosts_file = optarg;
+            break;
+        case 'd':
+            disk_dir = optarg;
+            break;
+        case 'D':
+            disk_capacity = atoi(optarg);
+            break;
+        case 'E':
+            policy = CachePolicy(optarg);
+            break;
+        case 'S':
+            g_snapshot_path = optarg;
+            break;
+        case 'P':
+            g_snapshot_period = atoi(optarg);
+            break;
+        case 'T':
+            stats_period = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || nthreads < 1 || queue_depth < 1 || nreactors < 1 || g_client_timeout < 1 ||
+        disk_capacity < 1 || policy == NULL || g_snapshot_period < 0 || stats_period < 0 ||
+        g_timeouts.connect < 0 || g_timeouts.read < 0 || g_timeouts.write < 0 || g_timeouts.total < 0 ||
+        max_per_origin < 0 || tunnel_ports < 0) {
+        usage(argv[0]);
     }
-    printf("proxy is listening on port: %s\n\n", argv[1]);
+    char *port = argv[optind];
+    StatsInit();
+    LogPrintf("proxy is listening on port: %s\n\n", port);
 
-    int listenfd = Open_listenfd(argv[1]);
+    /* a peer closing early shows up as a write error, not a fatal signal */
+    Signal(SIGPIPE, SIG_IGN);
+    /* before any thread starts, so they all inherit the mask */
+    if (g_snapshot_path != NULL) {
+        sigemptyset(&g_exit_signals);
+        sigaddset(&g_exit_signals, SIGINT);
+        sigaddset(&g_exit_signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &g_exit_signals, NULL);
+    }
+    LogInit();
+    DnsInit(hosts_file);
+    DiskInit(disk_dir, disk_capacity);
+    UpstreamInit(idle_timeout, max_per_origin);
+
+    /* one shard per event loop keeps lock contention at one loop's worth */
+    CacheInit(nshards ? nshards : (use_epoll ? nreactors : DEFAULT_SHARDS), policy);
+    StartSnapshots();
+    if (stats_period > 0) {
+        StatsStartDump(stats_period);
+    }
+
+    if (use_epoll) {
+        RunReactors(port, nreactors);
+    }
+
+    int listenfd = Open_listenfd(port);
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
 
-    CacheInit();
-    int *connfd;
+    sbuf_init(&g_connfds, queue_depth);
     pthread_t tid;
+    for (int i = 0; i < nthreads; i++) {
+        Pthread_create(&tid, NULL, ProcessTask, NULL);
+    }
 
     while (1) {
         clientlen = sizeof(clientaddr);
-        connfd = (int *) Malloc(sizeof(int));
-        *connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, ProcessTask, connfd);
+        int connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        StatsAdd(STAT_CONNECTIONS, 1);
+        /* blocks while the queue is full, leaving new clients in the listen backlog */
+        sbuf_insert(&g_connfds, connfd);
     }
 
     return 0;
 }
 
-void ProcessTask(void *context)
+/**
+ * @brief warm the cache up from the snapshot, and start saving it
+ */
+static void StartSnapshots(void)
+{
+    if (g_snapshot_path == NULL) {
+        return;
+    }
+    int loaded = CacheRestore(g_snapshot_path);
+    if (loaded >= 0) {
+        LogPrintf("loaded %d cached objects from %s\n", loaded, g_snapshot_path);
+    }
+
+    pthread_t tid;
+    Pthread_create(&tid, NULL, SnapshotThread, NULL);
+}
+
+/**
+ * @brief save the cache every g_snapshot_period seconds, and once more on an
+ * exit signal before exiting
+ */
+static void *SnapshotThread(void *vargp)
 {
-    int connfd = *((int *)context);
     Pthread_detach(pthread_self());
-    Free(context);
 
-    DealWithProxyRequest(connfd);
+    while (1) {
+        int sig;
+        if (g_snapshot_period > 0) {
+            struct timespec timeout = {g_snapshot_period, 0};
+            sig = sigtimedwait(&g_exit_signals, NULL, &timeout);
+        } else {
+            sig = sigwaitinfo(&g_exit_signals, NULL);
+        }
+        if (sig < 0 && errno == EINTR) {
+            continue;
+        }
+
+        WriteSnapshot();
+        if (sig > 0) {
+            LogFlush();
+            exit(0);
+        }
+    }
 
-    Close(connfd);
+    return NULL;
+}
+
+static void WriteSnapshot(void)
+{
+    int saved = CacheSnapshot(g_snapshot_path);
+    if (saved < 0) {
+        fprintf(stderr, "can not save cache to %s: %s\n", g_snapshot_path, strerror(errno));
+    } else {
+        LogPrintf("saved %d cached objects to %s\n", saved, g_snapshot_path);
+    }
+}
+
+/**
+ * @brief worker thread of the prethreaded pool, serves connections taken from g_connfds
+ */
+void *ProcessTask(void *context)
+{
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        int connfd = sbuf_remove(&g_connfds);
+        DealWithProxyRequest(connfd);
+        Close(connfd);
+    }
+
+    return NULL;
 }
 
 /**
- * @brief client connected to the proxy, proxy need to send a request to server,
- * then forward response received from server back to client.
+ * @brief client connected to the proxy, serve its requests one after another
+ * (pipelined ones included, ClientBuf keeps them) until either side wants the
+ * connection closed or the client stays idle for g_client_timeout seconds.
  * @param connfd used by connection between client and proxy
  */
 void DealWithProxyRequest(int connfd)
 {
-    rio_t rio;
-    Rio_readinitb(&rio, connfd);
-    char buf[MAXLINE];
+    ClientBuf client;
+    client.fd = connfd;
+    client.len = 0;
+    SocketTimeouts(connfd);
 
-    if (!Rio_readlineb(&rio, buf, MAXLINE)) {
-        return;
+    while (WaitForRequest(&client) && ServeProxyRequest(&client)) {
+    }
+}
+
+/**
+ * @return 1 if a request (or part of one) is ready to be read from client
+ */
+static int WaitForRequest(ClientBuf *client)
+{
+    if (client->len > 0) {
+        return 1;  // pipelined request already buffered
+    }
+
+    struct pollfd pfd;
+    pfd.fd = client->fd;
+    pfd.events = POLLIN;
+    int rc;
+    while ((rc = poll(&pfd, 1, g_client_timeout * 1000)) < 0 && errno == EINTR) {
+    }
+    return rc > 0;
+}
+
+/**
+ * @brief read the client's next request head and serve it
+ * @return 1 if the connection can carry the client's next request
+ */
+static int ServeProxyRequest(ClientBuf *client)
+{
+    HttpParser parser;
+    RequestTrace trace;
+    TraceStart(&trace, StatsNow());
+    int rc = ReadRequest(client, &parser);
+    if (rc == HTTP_PARTIAL) {
+        return 0;
+    }
+    TraceMark(&trace, TIME_PARSED);
+    if (rc == HTTP_ERROR) {
+        clienterror(client->fd, "", "400", "Bad Request", "Proxy could not parse the request");
+        LogPrintf("- %s %lld us\n", StatsName(trace.outcome), (long long)TraceFinish(&trace));
+        return 0;
+    }
+
+    int keep_alive = SliceCaseEqual(parser.method, "CONNECT") ? ServeTunnel(client, &parser, &trace)
+                                                                : ServeParsedRequest(client->fd, &parser, &trace);
+    long long us = TraceFinish(&trace);
+    LogPrintf("%.*s %s %lld us\n", (int)parser.target.len, parser.target.data,
+              StatsName(trace.outcome), us);
+
+    /* pipelined bytes behind the head move up for the next request */
+    client->len -= parser.off;
+    memmove(client->buf, client->buf + parser.off, client->len);
+    return keep_alive;
+}
+
+/**
+ * @brief receive into client until its buffer holds a whole request head
+ * @return HTTP_DONE, HTTP_ERROR if the head is malformed or does not fit, or
+ * HTTP_PARTIAL if the client went away first
+ */
+static int ReadRequest(ClientBuf *client, HttpParser *parser)
+{
+    HttpParserInit(parser, 0);
+    int rc;
+    while ((rc = HttpParse(parser, client->buf, client->len)) == HTTP_PARTIAL) {
+        if (client->len == MAXBUF) {
+            return HTTP_ERROR;
+        }
+        ssize_t n = read(client->fd, client->buf + client->len, MAXBUF - client->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return HTTP_PARTIAL;
+        }
+        client->len += n;
     }
-    printf("%s", buf);
+    return rc;
+}
 
-    char method[MAXLINE] = {0};
-    char url[MAXLINE] = {0};
-    char version[MAXLINE] = {0};
-    sscanf(buf, "%s %s %s", method, url, version);
+/**
+ * @brief proxy need to send a request to server, then forward response
+ * received from server back to client.
+ * @param parser holds the request head, its slices point into the client's buffer
+ * @return 1 if the connection can carry the client's next request
+ */
+static int ServeParsedRequest(int connfd, HttpParser *parser, RequestTrace *trace)
+{
+    char method[MAXLINE];
+    char url[MAXLINE];
+    SliceCopy(parser->method, method, MAXLINE);
+    SliceCopy(parser->target, url, MAXLINE);
 
-    int res = strcasecmp(method, "GET");
-    if (res != 0) {
+    /*
+     * request headers, the ones worth forwarding are kept for the server,
+     * pointing into the client's buffer. conditionals of the client are
+     * not: the response may be shared with other clients and cached, so it
+     * must be the full object
+     */
+    struct iovec headers[HTTP_MAX_HEADERS];
+    int nheaders = 0;
+    int conn_close = 0;
+    int conn_keep_alive = 0;
+    int gzip = 0;
+    int authorized = 0;
+    int partial = 0;
+    int cookie = 0;
+    for (int i = 0; i < parser->nheaders; i++) {
+        HttpHeader *header = &parser->headers[i];
+        ParseConnectionHeader(header, &conn_close, &conn_keep_alive);
+        gzip = gzip || AcceptsGzip(header);
+        authorized = authorized || header->id == HDR_AUTHORIZATION;
+        partial = partial || header->id == HDR_RANGE;
+        cookie = cookie || header->id == HDR_COOKIE;
+        if (IsNeedForward(header) && !IsConditional(header)) {
+            headers[nheaders].iov_base = (char *)header->line.data;
+            headers[nheaders].iov_len = header->line.len;
+            nheaders++;
+        }
+    }
+    int keep_alive = parser->version_minor >= 1 ? !conn_close : conn_keep_alive;
+
+    if (!SliceCaseEqual(parser->method, "GET")) {
         clienterror(connfd, method, "501", "Not implemented", "Tiny does not implement this method");
-        return;
+        return 0;
+    }
+    if (strcmp(url, STATS_PATH) == 0) {
+        TraceOutcome(trace, STAT_ADMIN);
+        return ServeAdmin(connfd);
+    }
+    if (strncmp(url, "http://", 7) != 0) {
+        clienterror(connfd, url, "400", "Bad Request", "Proxy only serves absolute http urls");
+        return 0;
     }
 
     char hostname[MAXLINE];
     char path[MAXLINE];
     ParseHostnamePath(url, MAXLINE, hostname, path, MAXLINE);
 
-    size_t object_len;
-    char *object;
-    if ((object = FindObejct(url, &object_len)) != NULL) {
-        SendClientCache(connfd, object, object_len);
-        return;
+    /* a stale entry is kept to revalidate it instead of fetching it again */
+    Entry *entry = FindObejct(url);
+    DiskRef ref;
+    int on_disk = entry == NULL && DiskFind(url, &ref);
+    TraceMark(trace, TIME_LOOKED_UP);
+    if (entry != NULL && CacheFresh(entry)) {
+        TraceOutcome(trace, STAT_HITS);
+        return ServeCached(connfd, entry, keep_alive, gzip, trace);
+    }
+    if (on_disk) {
+        TraceOutcome(trace, STAT_DISK_HITS);
+        return ServeDisk(connfd, &ref, keep_alive, trace);
     }
 
-    char port[MAXLINE];
-    int is_include_port = ExtractPort(hostname, MAXLINE, port, MAXLINE);
-    if (is_include_port == 0) {
-        strcpy(port, "80");
+    /*
+     * concurrent misses of url share one origin fetch, streamed to all of
+     * them. the flight is keyed by url alone, so a request for part of the
+     * object, or for its user's own version of it, fetches by itself
+     */
+    int leader = 1;
+    int shared = !authorized && !partial && !cookie;
+    Flight *flight = shared ? FlightJoin(url, &leader) : FlightSolo(url);
+    if (!leader) {
+        if (entry != NULL) {
+            ReleaseObject(entry);
+            entry = NULL;
+        }
+        int framed;
+        int rc = FlightSend(flight, connfd, keep_alive, &framed);
+        FlightRelease(flight);
+        if (rc >= 0) {
+            TraceOutcome(trace, STAT_COALESCED);
+            return keep_alive && rc == 1 && framed;
+        }
+        // leader failed before sending anything, try alone
+        flight = FlightSolo(url);
     }
 
-    // proxy connect to server
-    int client_fd = Open_clientfd(hostname, port);
-    if (client_fd < 0) {
-        return;
+    int delivered = FetchFromOrigin(connfd, url, hostname, path, headers, nheaders, flight, entry, keep_alive, authorized, trace);
+    FlightFinish(flight, FLIGHT_FAILED, NULL);  // ignored if the response got through
+    FlightRelease(flight);
+    if (entry != NULL) {
+        ReleaseObject(entry);
     }
+    return keep_alive && delivered;
+}
 
-    /* proxy send request to server */ 
-    ProxyRequestServer(&rio, client_fd, hostname, strlen(hostname), path, strlen(path));
+/**
+ * @brief answer GET STATS_PATH, the connection is closed after it
+ */
+static int ServeAdmin(int connfd)
+{
+    Chain response;
+    ChainInit(&response);
+    StatsResponse(connfd, &response);
+    SendClientCache(connfd, &response, 0, NULL);
+    ChainFree(&response);
+    return 0;
+}
 
-    /* proxy read response from server, then forward response back to client */
-    ProxyRespondClient(connfd, client_fd, url, strlen(url));
+/**
+ * @brief answer CONNECT host:port with a TCP tunnel to it and carry bytes
+ * both ways until both ends are done, the connection is closed after it
+ */
+static int ServeTunnel(ClientBuf *client, HttpParser *parser, RequestTrace *trace)
+{
+    char hostname[MAXLINE];
+    SliceCopy(parser->target, hostname, MAXLINE);
+    char *colon = strrchr(hostname, ':');
+    if (colon == NULL || colon == hostname || colon[1] == '\0') {
+        clienterror(client->fd, hostname, "400", "Bad Request", "Proxy tunnels only to host:port, not");
+        return 0;
+    }
+    *colon = '\0';
+    char *port = colon + 1;
+    if (!UpstreamTunnelAllowed(port)) {
+        clienterror(client->fd, port, "403", "Forbidden", "Proxy does not tunnel to port");
+        return 0;
+    }
+
+    /* a tunnel connection is never shared, so the pool is not asked for one */
+    TraceMark(trace, TIME_LOOKED_UP);
+    int server_fd = UpstreamConnect(hostname, port);
+    if (server_fd < 0) {
+        UpstreamError(client->fd, hostname, server_fd);
+        return 0;
+    }
+    TraceMark(trace, TIME_CONNECTED);
+
+    static const char established[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    if (rio_writen(client->fd, (void *)established, sizeof(established) - 1) < 0) {
+        UpstreamDiscard(hostname, port, server_fd);
+        return 0;
+    }
+    TraceMark(trace, TIME_FIRST_BYTE);
+    TraceOutcome(trace, STAT_TUNNELS);
+    StatsAdd(STAT_BYTES_OUT, sizeof(established) - 1);
 
-    close(client_fd);
+    /* whatever the client sent behind the head already belongs to the tunnel */
+    size_t early = client->len - parser->off;
+    if (early == 0 || rio_writen(server_fd, client->buf + parser->off, early) >= 0) {
+        StatsAdd(STAT_TUNNEL_BYTES_UP, early);
+        PumpTunnel(client->fd, server_fd);
+    }
+    client->len = parser->off;
+    UpstreamDiscard(hostname, port, server_fd);
+    return 0;
 }
 
 /**
- * @param url[in]: e.g. http://www.cmu.edu/hub/index.html
- * @param url_length: the length of url-array
- * @param hostname[out]: www.cmu.edu
- * @param path[out]: /hub/index.html
- * @param len: the length of hostname-array and path-array
+ * @brief relay connfd and server_fd to each other with splice until both
+ * directions have ended, one fails, or neither moves for g_timeouts.tunnel
  */
-static void ParseHostnamePath(char *url, int url_length, char *hostname, char *path, int len)
+static void PumpTunnel(int connfd, int server_fd)
 {
-    char prefix[] = "http://";
-    const int prefix_length = 7;
-    int hostname_length = 0;
-    int path_length = 0;
-    int end_parse_hostname = 0;
+    SpliceDir up, down;
+    int ok_up = SpliceDirInit(&up, connfd, server_fd) == 0;
+    int ok_down = SpliceDirInit(&down, server_fd, connfd) == 0;
+    fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
 
-    for (int i = 0; i < url_length; i++) {
-        if (i < prefix_length) {
-            assert(prefix[i] == url[i]);
-            continue;
+    while (ok_up && ok_down) {
+        size_t up_bytes = up.bytes;
+        size_t down_bytes = down.bytes;
+        int up_rc = SplicePump(&up, -1);
+        int down_rc = SplicePump(&down, -1);
+        StatsAdd(STAT_TUNNEL_BYTES_UP, up.bytes - up_bytes);
+        StatsAdd(STAT_TUNNEL_BYTES_DOWN, down.bytes - down_bytes);
+        if (up_rc < 0 || down_rc < 0 || (up_rc == SPLICE_DONE && down_rc == SPLICE_DONE)) {
+            break;
         }
 
-        if (!end_parse_hostname) {
-            if (url[i] == '\0' || url[i] == '/') {
-                path[path_length] = '/';
-                path_length++;
-                path[path_length] = '\0';
-                end_parse_hostname = 1;
-                continue;
-            }
-            hostname[hostname_length] = url[i];
-            hostname_length++;
-            hostname[hostname_length] = '\0';
-            continue;
+        /* each socket is read by one direction and written by the other */
+        struct pollfd pfd[2];
+        pfd[0].fd = connfd;
+        pfd[0].events = (up_rc == SPLICE_WANT_READ ? POLLIN : 0) | (down_rc == SPLICE_WANT_WRITE ? POLLOUT : 0);
+        pfd[1].fd = server_fd;
+        pfd[1].events = (down_rc == SPLICE_WANT_READ ? POLLIN : 0) | (up_rc == SPLICE_WANT_WRITE ? POLLOUT : 0);
+        int rc = poll(pfd, 2, g_timeouts.tunnel > 0 ? g_timeouts.tunnel * 1000 : -1);
+        if (rc == 0) {
+            StatsAdd(STAT_TIMEOUTS, 1);
+            break;
         }
-
-        if (url[i] == '\0') {
+        if ((rc < 0 && errno != EINTR) || ((pfd[0].revents | pfd[1].revents) & POLLERR)) {
             break;
         }
-        path[path_length] = url[i];
-        path_length++;
-        path[path_length] = '\0';
     }
+    SpliceDirClose(&up);
+    SpliceDirClose(&down);
 }
 
-static void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) 
+/**
+ * @brief send cached object to client and drop the reference to entry. a
+ * compressed object is decompressed for a client that does not take gzip
+ * @return 1 if the connection can carry the client's next request
+ */
+static int ServeCached(int connfd, Entry *entry, int keep_alive, int gzip, RequestTrace *trace)
 {
-    char buf[MAXLINE];
+    int sent;
+    if (!entry->compressed || gzip) {
+        sent = SendClientCache(connfd, &entry->object, keep_alive, trace) == 0;
+    } else {
+        Chain identity;
+        ChainInit(&identity);
+        sent = CacheIdentity(entry, &identity) == 0 &&
+               SendClientCache(connfd, &identity, keep_alive, trace) == 0;
+        ChainFree(&identity);
+    }
+    keep_alive = keep_alive && sent && entry->meta.framed;
+    ReleaseObject(entry);
+    return keep_alive;
+}
 
-    /* Print the HTTP response headers */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+/**
+ * @brief send object found on disk to client straight from its segment, and
+ * drop the reference
+ * @return 1 if the connection can carry the client's next request
+ */
+static int ServeDisk(int connfd, DiskRef *ref, int keep_alive, RequestTrace *trace)
+{
+    size_t off = 0;
+    TraceMark(trace, TIME_FIRST_BYTE);
 
-    /* Print the HTTP response body */
-    sprintf(buf, "<html><title>Tiny Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<body bgcolor=""ffffff"">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<hr><em>The Tiny Web server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    /* a head to rewrite is read from the mapping, the rest sent from the file */
+    const char *object = ref->segment->base + ref->offset;
+    size_t at = keep_alive ? 0 : KeepAliveAt(object, ref->len);
+    if (at > 0) {
+        ssize_t n = WriteClosingHead(connfd, object, at);
+        if (n < 0) {
+            DiskRelease(ref);
+            return 0;
+        }
+        StatsAdd(STAT_BYTES_OUT, n);
+        off = at + strlen(KEEP_ALIVE_LINE);
+    }
+    size_t start = off;
+    while (off < ref->len) {
+        ssize_t n = DiskSendfile(ref, connfd, off);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        off += n;
+    }
+    StatsAdd(STAT_BYTES_OUT, off - start);
+    keep_alive = keep_alive && off == ref->len && ref->framed;
+    DiskRelease(ref);
+    return keep_alive;
 }
 
 /**
- * if hostname specifys a port, cut the port from hostname
- * @return 1 if hostname specify the port, otherwise 0
+ * @param flight led by caller, gets the response as it is relayed
+ * @param stale cached entry to revalidate, or NULL
+ * @param keep_alive client keeps its connection for another request
+ * @param authorized request carries Authorization, see ResponseCacheable
+ * @return 1 if client got a whole response that ends by itself
  */
-static int ExtractPort(char *hostname, int host_len, char *port, int port_len)
+static int FetchFromOrigin(int connfd, char *url, char *hostname, char *path, struct iovec *headers, int nheaders, Flight *flight, Entry *stale, int keep_alive, int authorized, RequestTrace *trace)
 {
-    for (int i = 0; i < host_len; i++) {
-        if (hostname[i] == ':') {
-            strcpy(port, hostname + i + 1);
-            hostname[i] = '\0';
-            return 1;
-        }
+    char port[MAXLINE];
+    int is_include_port = ExtractPort(hostname, MAXLINE, port, MAXLINE);
+    if (is_include_port == 0) {
+        strcpy(port, "80");
+    }
 
-        if (hostname[i] == '\0') {
+    // proxy connect to server, reusing an idle keep-alive connection if there is one
+    int reused;
+    int client_fd = UpstreamAcquire(hostname, port, &reused);
+    if (client_fd < 0) {
+        UpstreamError(connfd, hostname, client_fd);
+        return 0;
+    }
+    TraceMark(trace, TIME_CONNECTED);
+
+    /*
+     * proxy send request to server, then forward its response back to client.
+     * a pooled connection the origin closed meanwhile fails before the first
+     * response byte, the request is tried once more on a new one then
+     */
+    int delivered = 0;
+    int rc;
+    while (1) {
+        if (ProxyRequestServer(client_fd, hostname, strlen(hostname), path, strlen(path), headers, nheaders, stale) < 0) {
+            rc = OriginFailure(-1);
+        } else {
+            rc = ProxyRespondClient(connfd, client_fd, url, strlen(url), flight, stale, keep_alive, authorized, &delivered, trace);
+        }
+        if (rc != ORIGIN_SILENT || !reused) {
+            break;
+        }
+        UpstreamDiscard(hostname, port, client_fd);
+        reused = 0;
+        if ((client_fd = UpstreamConnect(hostname, port)) < 0) {
+            UpstreamError(connfd, hostname, client_fd);
             return 0;
         }
     }
-    return 0;
+
+    if (rc == ORIGIN_TIMEOUT) {
+        StatsAdd(STAT_TIMEOUTS, 1);
+        clienterror(connfd, hostname, "504", "Gateway Timeout", "Proxy timed out waiting for");
+    } else if (rc == ORIGIN_SILENT) {
+        clienterror(connfd, hostname, "502", "Bad Gateway", "Proxy got no response from");
+    }
+    if (rc > 0) {
+        UpstreamRelease(hostname, port, client_fd);
+    } else {
+        UpstreamDiscard(hostname, port, client_fd);
+    }
+    return delivered;
 }
 
 /**
- * @param rio used to read request headers from client
- * @param client_fd used by connection between proxy and server
+ * @brief tell the client why no connection to hostname could be had
+ * @param rc what UpstreamAcquire or UpstreamConnect returned
  */
-static void ProxyRequestServer(rio_t *rio, int client_fd, char *hostname, size_t host_len, char *path, size_t path_len)
+static void UpstreamError(int connfd, char *hostname, int rc)
 {
-    char buf[MAXLINE];
-    // send HTTP request line
-    strcpy(buf, "GET ");
-    strcat(buf, path);
-    strcat(buf, " HTTP/1.0\r\n");
-    Rio_writen(client_fd, buf, strlen(buf));
+    if (rc == UPSTREAM_BUSY) {
+        StatsAdd(STAT_ORIGIN_BUSY, 1);
+        clienterror(connfd, hostname, "503", "Service Unavailable", "Proxy has too many requests waiting for");
+    } else if (rc == UPSTREAM_TIMEOUT) {
+        StatsAdd(STAT_TIMEOUTS, 1);
+        clienterror(connfd, hostname, "504", "Gateway Timeout", "Proxy timed out connecting to");
+    } else {
+        clienterror(connfd, hostname, "502", "Bad Gateway", "Proxy could not connect to");
+    }
+}
 
-    // send HTTP request headers
-    strcpy(buf, "Host: ");
-    strcat(buf, hostname);
-    strcat(buf, "\r\n");
-    Rio_writen(client_fd, buf, strlen(buf));
+/**
+ * @brief send an error page, header and body in one writev. a client that
+ * is gone already is not an error of the proxy
+ */
+static void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) 
+{
+    char header[MAXLINE];
+    char body[2 * MAXLINE];  // cause is at most a MAXLINE string
+    struct iovec iov[2];
 
-    strcpy(buf, user_agent_hdr);
-    Rio_writen(client_fd, buf, strlen(buf));
+    iov[0].iov_base = header;
+    iov[0].iov_len = snprintf(header, MAXLINE, "HTTP/1.0 %s %s\r\nContent-type: text/html\r\n\r\n",
+                              errnum, shortmsg);
+    iov[1].iov_base = body;
+    iov[1].iov_len = snprintf(body, sizeof(body), "<html><title>Tiny Error</title>"
+                              "<body bgcolor=""ffffff"">\r\n"
+                              "%s: %s\r\n"
+                              "<p>%s: %s\r\n"
+                              "<hr><em>The Tiny Web server</em>\r\n",
+                              errnum, shortmsg, longmsg, cause);
+    if (rio_writevn(fd, iov, 2) > 0) {
+        StatsAdd(STAT_BYTES_OUT, iov[0].iov_len + iov[1].iov_len);
+    }
+}
 
-    strcpy(buf, "Connection: close\r\n");
-    Rio_writen(client_fd, buf, strlen(buf));
+/**
+ * @brief send the rewritten request line and headers, with the client's
+ * headers taken from its buffer as they are, in one writev
+ * @param client_fd used by connection between proxy and server
+ * @param headers request headers of client to forward to server
+ * @param stale cached entry to ask the server about, or NULL
+ * @return 0 on success, -1 if the request could not be sent
+ */
+static int ProxyRequestServer(int client_fd, char *hostname, size_t host_len, char *path, size_t path_len, struct iovec *headers, int nheaders, Entry *stale)
+{
+    static char get[] = "GET ";
+    static char host[] = " HTTP/1.1\r\nHost: ";
+    // ask the server to keep the connection open for the next request
+    static char connection[] = "Connection: keep-alive\r\n";
+    static char crlf[] = "\r\n";
+    struct iovec iov[HTTP_MAX_HEADERS + 9];
+    int iovcnt = 0;
 
-    strcpy(buf, "Proxy-Connection: close\r\n");
-    Rio_writen(client_fd, buf, strlen(buf));
+    iovcnt = PushIov(iov, iovcnt, get, sizeof(get) - 1);
+    iovcnt = PushIov(iov, iovcnt, path, path_len);
+    iovcnt = PushIov(iov, iovcnt, host, sizeof(host) - 1);
+    iovcnt = PushIov(iov, iovcnt, hostname, host_len);
+    iovcnt = PushIov(iov, iovcnt, crlf, sizeof(crlf) - 1);
+    iovcnt = PushIov(iov, iovcnt, (char *)user_agent_hdr, strlen(user_agent_hdr));
+    iovcnt = PushIov(iov, iovcnt, connection, sizeof(connection) - 1);
 
     // forward additional request headers sended by client to server
-    do {
-        Rio_readlineb(rio, buf, MAXLINE);
-        if (IsNeedForward(buf, strlen(buf)) == 1) {
-            Rio_writen(client_fd, buf, strlen(buf));
-        }
-    } while (strcmp(buf, "\r\n") != 0);
+    for (int i = 0; i < nheaders; i++) {
+        iov[iovcnt++] = headers[i];
+    }
 
-    strcpy(buf, "\r\n");
-    Rio_writen(client_fd, buf, strlen(buf));
+    // let the server answer 304 if the cached object is still current
+    char conditional[2 * MAXLINE];
+    size_t len = 0;
+    if (stale != NULL && stale->meta.etag[0] != '\0') {
+        len += snprintf(conditional + len, sizeof(conditional) - len, "If-None-Match: %s\r\n",
+                        stale->meta.etag);
+    }
+    if (stale != NULL && stale->meta.last_modified[0] != '\0') {
+        len += snprintf(conditional + len, sizeof(conditional) - len, "If-Modified-Since: %s\r\n",
+                        stale->meta.last_modified);
+    }
+    iovcnt = PushIov(iov, iovcnt, conditional, len);
+    iovcnt = PushIov(iov, iovcnt, crlf, sizeof(crlf) - 1);
+
+    return rio_writevn(client_fd, iov, iovcnt) < 0 ? -1 : 0;
+}
+
+static inline int PushIov(struct iovec *iov, int iovcnt, char *base, size_t len)
+{
+    iov[iovcnt].iov_base = base;
+    iov[iovcnt].iov_len = len;
+    return iovcnt + 1;
 }
 
 /**
  * @param connfd used by connection between client and proxy
  * @param client_fd used by connection between proxy and server
+ * @param flight led by caller, gets the response as it is relayed
+ * @param stale cached entry the request was conditional on, or NULL
+ * @param keep_alive client keeps its connection for another request
+ * @param authorized request carries Authorization, see ResponseCacheable
+ * @param delivered[out] 1 if client got a whole response that ends by itself,
+ * so connfd can carry the client's next request
+ * @param trace gets the outcome and the time of the first byte to the client
+ * @return 1 if the whole response was relayed and client_fd can carry
+ * another request, otherwise 0, or ORIGIN_SILENT or ORIGIN_TIMEOUT if no
+ * whole response head arrived and client was sent nothing
  */
-static void ProxyRespondClient(int connfd, int client_fd, char *url, size_t url_len)
+static int ProxyRespondClient(int connfd, int client_fd, char *url, size_t url_len, Flight *flight, Entry *stale, int keep_alive, int authorized, int *delivered, RequestTrace *trace)
 {
-    char buf[MAXLINE];
+    *delivered = 0;
+
+    Relay relay;
+    rio_readinitb(&relay.rio, client_fd);
+    relay.connfd = connfd;
+    relay.flight = flight;
+    relay.keep = 1;
+    relay.client_ok = 1;
+    relay.deadline = g_timeouts.total > 0 ? time(NULL) + g_timeouts.total : 0;
+
+    // status line and headers, held back until it is known who may see them
+    ResponseHead head;
+    Chain header;
+    Chain fields;
+    ChainInit(&header);
+    ChainInit(&fields);
+    char line[MAXLINE];
     ssize_t n;
-    ssize_t sum = 0;
-
-    char *cache = (char *)Malloc(MAX_OBJECT_SIZE);
-    char *temp = cache;
-    int can_cache = 1;
-
-    // read HTTP response
-    while ((n = Rio_readn(client_fd, buf, MAXLINE)) > 0) {
-        if (can_cache) {
-            sum += n;
-            if (sum <= MAX_OBJECT_SIZE) {
-                memcpy(temp, buf, n);
-                temp += n;
-            } else {
-                can_cache = 0;
+    if ((n = rio_readlineb(&relay.rio, line, MAXLINE)) <= 0) {
+        return OriginFailure(n);
+    }
+    ParseStatusLine(line, &head);
+    ChainAppend(&header, line, n);
+    while ((n = rio_readlineb(&relay.rio, line, MAXLINE)) > 0) {
+        if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) {
+            /*
+             * connection headers are hop-by-hop, replace the server's with the
+             * proxy's own: the client connection can persist iff the response
+             * ends by itself. it goes right after the status line, where
+             * SendClientCache turns it into close for a client that does not
+             * keep its connection
+             */
+            char *connection = ResponseFramed(&head) ? KEEP_ALIVE_LINE : CLOSE_LINE;
+            ChainAppend(&header, connection, strlen(connection));
+            for (Chunk *chunk = fields.head; chunk != NULL; chunk = chunk->next) {
+                ChainAppend(&header, chunk->data, chunk->len);
             }
+            ChainAppend(&header, line, n);
+            break;
+        }
+        HttpHeader parsed;
+        if (!HttpParseHeader(line, n, &parsed)) {
+            continue;  // not a header, dropped
+        }
+        ParseResponseHeader(&parsed, &head);
+        if (!IsHopByHop(&parsed)) {
+            ChainAppend(&fields, line, n);
+        }
+    }
+    ChainFree(&fields);
+    if (n <= 0) {
+        int rc = OriginFailure(n);
+        ChainFree(&header);
+        return rc;
+    }
+
+    CacheMeta meta;
+    CacheMetaInit(&meta, &head);
+    int revalidated = head.status == 304 && stale != NULL;
+    TraceOutcome(trace, revalidated ? STAT_REVALIDATED : STAT_MISSES);
+    if (revalidated) {
+        /* cached object is still current, it goes out instead of the 304 */
+        meta.framed = stale->meta.framed;
+        if (meta.etag[0] == '\0') {
+            strcpy(meta.etag, stale->meta.etag);
+        }
+        if (meta.last_modified[0] == '\0') {
+            strcpy(meta.last_modified, stale->meta.last_modified);
         }
-        
-        Rio_writen(connfd, buf, n);
+        if (stale->compressed) {
+            /* the flight may have clients that do not take gzip */
+            Chain identity;
+            ChainInit(&identity);
+            CacheIdentity(stale, &identity);
+            FlightAppendChain(flight, &identity);
+            ChainFree(&identity);
+        } else {
+            FlightAppendChain(flight, &stale->object);
+        }
+    } else if (head.no_store || head.is_private || head.vary_other) {
+        /*
+         * meant for this client alone, or chosen by request headers the
+         * followers may not share: they fetch it by themselves, not a byte
+         * of it is published
+         */
+        FlightUncacheable(flight, 0);
+        relay.keep = 0;
+    } else {
+        FlightAppendChain(flight, &header);
     }
 
-    if (can_cache) {
-        CacheObject(url, url_len, cache, sum);
+    /* only the leader appends to object, so it may read it without the lock */
+    if (SendClientCache(connfd, relay.keep ? &flight->object : &header, keep_alive, trace) < 0) {
+        relay.client_ok = 0;
+    }
+    ChainFree(&header);
+    if ((!revalidated && !ResponseCacheable(&head, authorized)) || head.content_length > MAX_OBJECT_SIZE) {
+        StopCaching(&relay);
     }
 
-    Free(cache);
+    // body, ended by Content-Length, chunked encoding, or the server closing
+    int complete;
+    int reusable = ResponseKeepAlive(&head);
+    if (!ResponseHasBody(&head)) {
+        complete = 1;
+    } else if (head.chunked) {
+        complete = RelayChunked(&relay) == 0;
+    } else if (head.content_length >= 0) {
+        complete = RelayBody(&relay, head.content_length) == 0;
+    } else {
+        complete = RelayBody(&relay, SPLICE_UNTIL_EOF) == 0;
+    }
+
+    /* the object is cached once the last follower is done with it */
+    FlightFinish(flight, complete ? FLIGHT_COMPLETE : FLIGHT_FAILED, &meta);
+    *delivered = complete && relay.client_ok && meta.framed;
+    return complete && reusable && relay.rio.rio_cnt == 0;
 }
 
 /**
- * @brief if request header contains one of ["Host", "User-Agent", "Connection", "Proxy-Connection"],
- * no need to forward to server, return 0, otherwise return 1.
+ * @param keep_alive client keeps its connection, otherwise a stored
+ * KEEP_ALIVE_LINE goes out as CLOSE_LINE
+ * @param trace marked at the first byte, or NULL
+ * @return 0 on success, -1 if client can not be written
  */
-static int IsNeedForward(const char *request_header, size_t header_len)
+static inline int SendClientCache(int connfd, Chain *cache_object, int keep_alive, RequestTrace *trace)
 {
-    if (strstr(request_header, "Host") ||
-        strstr(request_header, "User-Agent") ||
-        strstr(request_header, "Connection") ||
-        strstr(request_header, "Proxy-Connection")) {
+    if (trace != NULL) {
+        TraceMark(trace, TIME_FIRST_BYTE);
+    }
+    Chunk *first = cache_object->head;
+    size_t at = keep_alive || first == NULL ? 0 : KeepAliveAt(first->data, first->len);
+    if (at == 0) {
+        if (ChainWriten(connfd, cache_object) < 0) {
+            return -1;
+        }
+        StatsAdd(STAT_BYTES_OUT, cache_object->len);
         return 0;
     }
-    
+
+    ssize_t n = WriteClosingHead(connfd, first->data, at);
+    if (n < 0) {
+        return -1;
+    }
+    StatsAdd(STAT_BYTES_OUT, n);
+    for (size_t off = at + strlen(KEEP_ALIVE_LINE); off < cache_object->len; off += n) {
+        if ((n = ChainWritev(connfd, cache_object, off)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            return -1;
+        }
+        StatsAdd(STAT_BYTES_OUT, n);
+    }
+    return 0;
+}
+
+/**
+ * @brief the object is too big for the cache. it is still kept for the
+ * followers already streaming it, with nobody following it is dropped
+ */
+static void StopCaching(Relay *relay)
+{
+    if (FlightUncacheable(relay->flight, 1)) {
+        relay->keep = 0;
+    }
+}
+
+/**
+ * @brief send n bytes to client unless it is gone already
+ * @return 0 while the bytes are still needed by the client or the flight,
+ * -1 once nobody needs them
+ */
+static int SendToClient(Relay *relay, char *data, size_t n)
+{
+    if (relay->client_ok && rio_writen(relay->connfd, data, n) < 0) {
+        relay->client_ok = 0;
+    } else if (relay->client_ok) {
+        StatsAdd(STAT_BYTES_OUT, n);
+    }
+    return relay->client_ok || relay->keep ? 0 : -1;
+}
+
+/**
+ * @brief send n bytes to client, and keep a copy for followers and the cache
+ * @return 0 on success, -1 once nobody needs the bytes
+ */
+static int RelayBytes(Relay *relay, char *data, size_t n)
+{
+    if (relay->keep && relay->flight->object.len + n > MAX_OBJECT_SIZE) {
+        StopCaching(relay);
+    }
+    if (relay->keep) {
+        FlightAppend(relay->flight, data, n);
+    }
+    return SendToClient(relay, data, n);
+}
+
+/**
+ * @brief relay the next n bytes of origin response, or everything up to EOF
+ * if n is SPLICE_UNTIL_EOF
+ * @return 0 on success, -1 on error or early EOF
+ */
+static int RelayBody(Relay *relay, size_t n)
+{
+    char buf[MAXBUF];
+
+    while (n > 0) {
+        if ((!relay->keep && !relay->client_ok) || Expired(relay)) {
+            return -1;
+        }
+        if (!relay->keep && relay->rio.rio_cnt == 0) {
+            /* nobody else needs the bytes, let the kernel move the rest */
+            ssize_t m = SpliceRelay(relay->rio.rio_fd, relay->connfd, n, relay->deadline);
+            StatsAdd(STAT_BYTES_OUT, m > 0 ? m : 0);
+            return (m < 0 || (n != SPLICE_UNTIL_EOF && m != n)) ? -1 : 0;
+        }
+
+        /* while keeping the object, read straight into it */
+        char *data = buf;
+        size_t space = MAXBUF;
+        if (relay->keep) {
+            data = FlightReserve(relay->flight, &space);
+        }
+        if (space > n) {
+            space = n;
+        }
+
+        ssize_t m = rio_readnb(&relay->rio, data, space);
+        if (m < 0) {
+            return -1;
+        }
+        if (m == 0) {
+            return n == SPLICE_UNTIL_EOF ? 0 : -1;
+        }
+
+        if (relay->keep) {
+            FlightCommit(relay->flight, m);
+        }
+        if (relay->keep && relay->flight->object.len > MAX_OBJECT_SIZE) {
+            StopCaching(relay);
+        }
+        if (SendToClient(relay, data, m) < 0) {
+            return -1;
+        }
+        if (n != SPLICE_UNTIL_EOF) {
+            n -= m;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief relay a chunked body as is, chunk size lines and trailer included
+ * @return 0 on success, -1 on error or early EOF
+ */
+static int RelayChunked(Relay *relay)
+{
+    char line[MAXLINE];
+    ssize_t n;
+
+    while (1) {
+        if (Expired(relay) || (n = rio_readlineb(&relay->rio, line, MAXLINE)) <= 0 ||
+            RelayBytes(relay, line, n) < 0) {
+            return -1;
+        }
+        long size = strtol(line, NULL, 16);
+        if (size <= 0) {
+            break;
+        }
+        /* chunk data and its trailing CRLF */
+        if (RelayBody(relay, size + 2) < 0) {
+            return -1;
+        }
+    }
+
+    // optional trailer headers, up to a blank line
+    do {
+        if ((n = rio_readlineb(&relay->rio, line, MAXLINE)) <= 0 ||
+            RelayBytes(relay, line, n) < 0) {
+            return -1;
+        }
+    } while (strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0);
+    return 0;
+}
+
+/**
+ * @return 1 once the response has taken longer than g_timeouts.total
+ */
+static int Expired(Relay *relay)
+{
+    if (relay->deadline == 0 || time(NULL) < relay->deadline) {
+        return 0;
+    }
+    StatsAdd(STAT_TIMEOUTS, 1);
     return 1;
 }
 
-static inline void SendClientCache(int connfd, char *cache_object, size_t object_len)
+/**
+ * @param rc result of the origin read or write that failed
+ * @return ORIGIN_TIMEOUT if it timed out, ORIGIN_SILENT otherwise
+ */
+static int OriginFailure(ssize_t rc)
 {
-    Rio_writen(connfd, cache_object, object_len);
+    return rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? ORIGIN_TIMEOUT : ORIGIN_SILENT;
 }
 
 static void test_ParseHostnamePath()
@@ -339,4 +1202,4 @@ static void test_ExtractPort()
     char port[MAXLINE];
     ExtractPort(hostname, MAXLINE, port, MAXLINE);
     assert(strcmp(port, "15213") == 0);
-}
\ No newline at end of file
+}
@@ -0,0 +1,130 @@
+#define _GNU_SOURCE  // splice, pipe2
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "relay.h"
+
+/* pipe reused by every SpliceRelay of the calling thread */
+static __thread int t_pipe[2] = {-1, -1};
+
+ssize_t SpliceRelay(int from_fd, int to_fd, size_t len, time_t deadline)
+{
+    if (t_pipe[0] < 0 && pipe2(t_pipe, O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    ssize_t total = 0;
+    while (len > 0) {
+        if (deadline != 0 && time(NULL) >= deadline) {
+            return -1;  // the pipe is empty between chunks
+        }
+        size_t want = len < SPLICE_CHUNK ? len : SPLICE_CHUNK;
+        ssize_t n = splice(from_fd, NULL, t_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;  // nothing left in the pipe, it can be reused
+        }
+        if (n == 0) {
+            return total;
+        }
+
+        while (n > 0) {
+            ssize_t m = splice(t_pipe[0], NULL, to_fd, NULL, n, SPLICE_F_MOVE);
+            if (m < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                goto broken;
+            }
+            n -= m;
+            total += m;
+            if (len != SPLICE_UNTIL_EOF) {
+                len -= m;
+            }
+        }
+    }
+    return total;
+
+broken:
+    /* the pipe may still hold bytes of this response, never reuse it */
+    close(t_pipe[0]);
+    close(t_pipe[1]);
+    t_pipe[0] = t_pipe[1] = -1;
+    return -1;
+}
+
+int SplicePipe(int pipefd[2])
+{
+    return pipe2(pipefd, O_NONBLOCK | O_CLOEXEC);
+}
+
+ssize_t SpliceMove(int in_fd, int out_fd, size_t len)
+{
+    return splice(in_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+int SpliceDirInit(SpliceDir *dir, int from, int to)
+{
+    dir->from = from;
+    dir->to = to;
+    dir->piped = 0;
+    dir->eof = 0;
+    dir->done = 0;
+    dir->bytes = 0;
+    if (SplicePipe(dir->pipefd) < 0) {
+        dir->pipefd[0] = dir->pipefd[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int SplicePump(SpliceDir *dir, int budget)
+{
+    while (!dir->done) {
+        if (dir->piped > 0) {
+            ssize_t n = SpliceMove(dir->pipefd[0], dir->to, dir->piped);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN ? SPLICE_WANT_WRITE : -1;
+            }
+            dir->piped -= n;
+            dir->bytes += n;
+            continue;
+        }
+        if (dir->eof) {
+            shutdown(dir->to, SHUT_WR);
+            dir->done = 1;
+            break;
+        }
+        if (budget-- == 0) {
+            return SPLICE_WANT_READ;  // more may be ready, level-triggered waits say so
+        }
+
+        ssize_t n = SpliceMove(dir->from, dir->pipefd[1], SPLICE_CHUNK);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN ? SPLICE_WANT_READ : -1;
+        }
+        if (n == 0) {
+            dir->eof = 1;
+        }
+        dir->piped = n;
+    }
+    return SPLICE_DONE;
+}
+
+void SpliceDirClose(SpliceDir *dir)
+{
+    if (dir->pipefd[0] >= 0) {
+        close(dir->pipefd[0]);
+        close(dir->pipefd[1]);
+        dir->pipefd[0] = dir->pipefd[1] = -1;
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * zero-copy relay between sockets: bytes are moved from one socket into a
+ * pipe and from the pipe into the other socket with splice(2), so they never
+ * cross into user space.
+ *
+ * a tunnel is two SpliceDirs, one per direction, each pumped without
+ * blocking until it has to wait for one of its sockets; the caller waits for
+ * what SplicePump asks for, with poll or epoll. a direction that reaches EOF
+ * shuts the other socket down for writing once its last byte is through,
+ * so a half-close travels to the other end while the opposite direction
+ * goes on.
+ */
+
+#define SPLICE_CHUNK 65536  // default pipe capacity
+#define SPLICE_UNTIL_EOF ((size_t)-1)
+
+/* results of SplicePump */
+#define SPLICE_WANT_READ 1   // wait for from to become readable
+#define SPLICE_WANT_WRITE 2  // wait for to to become writable
+#define SPLICE_DONE 3        // EOF passed on, nothing more to do
+
+/* one direction of a tunnel, from and to must be non-blocking */
+typedef struct {
+    int from;
+    int to;
+    int pipefd[2];
+    size_t piped;  // bytes waiting in the pipe
+    int eof;       // from has no more to send
+    int done;      // to was shut down for writing after the last byte
+    size_t bytes;  // relayed so far
+} SpliceDir;
+
+/**
+ * @brief blocking relay of len bytes from from_fd to to_fd, or everything
+ * up to EOF on from_fd if len is SPLICE_UNTIL_EOF
+ * @param deadline time to give up at, checked between chunks, or 0
+ * @return bytes relayed (less than len on early EOF), or -1 on error
+ */
+ssize_t SpliceRelay(int from_fd, int to_fd, size_t len, time_t deadline);
+
+/**
+ * @brief create a non-blocking pipe for SpliceMove
+ */
+int SplicePipe(int pipefd[2]);
+
+/**
+ * @brief one non-blocking splice of at most len bytes, either in_fd or
+ * out_fd must be a pipe end
+ * @return as splice(2)
+ */
+ssize_t SpliceMove(int in_fd, int out_fd, size_t len);
+
+/**
+ * @return 0, or -1 if no pipe could be made
+ */
+int SpliceDirInit(SpliceDir *dir, int from, int to);
+
+/**
+ * @brief move the bytes of dir that can be moved without blocking
+ * @param budget reads from from before yielding, -1 for no limit
+ * @return SPLICE_WANT_READ, SPLICE_WANT_WRITE, SPLICE_DONE, or -1 on error
+ */
+int SplicePump(SpliceDir *dir, int budget);
+
+void SpliceDirClose(SpliceDir *dir);
+
+#endif
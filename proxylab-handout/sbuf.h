@@ -0,0 +1,26 @@
+#ifndef SBUF_H
+#define SBUF_H
+
+#include "csapp.h"
+
+/**
+ * bounded producer/consumer queue of connected descriptors (CS:APP 12.5.4).
+ * sbuf_insert blocks while the queue is full, so a slow worker pool pushes
+ * back on the accept loop instead of growing without bound.
+ */
+typedef struct {
+    int *buf;     /* Buffer array */
+    int n;        /* Maximum number of slots */
+    int front;    /* buf[(front+1)%n] is first item */
+    int rear;     /* buf[rear%n] is last item */
+    sem_t mutex;  /* Protects accesses to buf */
+    sem_t slots;  /* Counts available slots */
+    sem_t items;  /* Counts available items */
+} sbuf_t;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+
+#endif
@@ -0,0 +1,71 @@
+#include <string.h>
+#include "sketch.h"
+
+static inline unsigned long Mix(unsigned long hash);
+static inline unsigned SketchIndex(unsigned long hash, int row);
+static void Age(Sketch *sketch);
+
+void SketchInit(Sketch *sketch)
+{
+    memset(sketch, 0, sizeof(Sketch));
+}
+
+void SketchIncrement(Sketch *sketch, unsigned long hash)
+{
+    hash = Mix(hash);
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint8_t *counter = &sketch->counters[row][SketchIndex(hash, row)];
+        if (__atomic_load_n(counter, __ATOMIC_RELAXED) < SKETCH_MAX) {
+            __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* exactly one caller reaches the sample size, and ages the sketch */
+    if (__atomic_add_fetch(&sketch->additions, 1, __ATOMIC_RELAXED) == SKETCH_SAMPLE) {
+        Age(sketch);
+    }
+}
+
+int SketchEstimate(Sketch *sketch, unsigned long hash)
+{
+    hash = Mix(hash);
+    int estimate = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        int count = __atomic_load_n(&sketch->counters[row][SketchIndex(hash, row)], __ATOMIC_RELAXED);
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+    return estimate;
+}
+
+/**
+ * @brief urls differing only in their last bytes leave the high bits of
+ * their hashes alike, spread them over all bits (splitmix64 finalizer)
+ */
+static inline unsigned long Mix(unsigned long hash)
+{
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9UL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebUL;
+    return hash ^ (hash >> 31);
+}
+
+/**
+ * @brief double hashing, the high half of hash steps through the rows
+ */
+static inline unsigned SketchIndex(unsigned long hash, int row)
+{
+    unsigned long step = (hash >> 32) | 1;
+    return (hash + row * step) & (SKETCH_WIDTH - 1);
+}
+
+static void Age(Sketch *sketch)
+{
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        for (int i = 0; i < SKETCH_WIDTH; i++) {
+            uint8_t *counter = &sketch->counters[row][i];
+            __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&sketch->additions, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,40 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+
+/**
+ * count-min sketch estimating how often a key was seen recently, for cache
+ * admission (TinyLFU). a key is counted in one small saturating counter per
+ * row, each row indexed by a different hash of the key, and its estimate is
+ * the smallest of those counters, so collisions only ever overestimate.
+ * every SKETCH_SAMPLE increments all counters are halved, so old popularity
+ * fades and the sketch follows changes in what is hot.
+ *
+ * counters are updated with relaxed atomics and without a lock: a lost or
+ * doubled update only blurs an estimate that is approximate anyway.
+ */
+
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096  // counters per row, must be a power of 2
+#define SKETCH_MAX 15      // counters saturate here, as 4 bit counters would
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH)  // increments between agings
+
+typedef struct {
+    uint8_t counters[SKETCH_DEPTH][SKETCH_WIDTH];
+    unsigned additions;  // increments since the last aging
+} Sketch;
+
+void SketchInit(Sketch *sketch);
+
+/**
+ * @brief count one more occurrence of the key hashed to hash
+ */
+void SketchIncrement(Sketch *sketch, unsigned long hash);
+
+/**
+ * @return estimated occurrences of the key hashed to hash, at most SKETCH_MAX
+ */
+int SketchEstimate(Sketch *sketch, unsigned long hash);
+
+#endif
@@ -0,0 +1,294 @@
+#include "csapp.h"
+#include "stats.h"
+#include "cache.h"
+#include "logger.h"
+
+__thread StatsSlot *t_stats;
+
+static StatsSlot *g_slots;  // every thread's slot, pushed on registration only
+static pthread_mutex_t g_slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int64_t g_started;   // StatsNow at StatsInit
+
+static const char *g_counter_names[STAT_COUNT] = {
+    [STAT_CONNECTIONS] = "connections",
+    [STAT_REQUESTS] = "requests",
+    [STAT_HITS] = "hit",
+    [STAT_DISK_HITS] = "disk_hit",
+    [STAT_MISSES] = "miss",
+    [STAT_REVALIDATED] = "revalidated",
+    [STAT_COALESCED] = "coalesced",
+    [STAT_ADMIN] = "admin",
+    [STAT_TUNNELS] = "tunnel",
+    [STAT_ERRORS] = "error",
+    [STAT_BYTES_OUT] = "bytes_out",
+    [STAT_CACHE_INSERTS] = "cache_inserts",
+    [STAT_CACHE_REJECTS] = "cache_rejects",
+    [STAT_CACHE_EVICTIONS] = "cache_evictions",
+    [STAT_CACHE_EVICTED_BYTES] = "cache_evicted_bytes",
+    [STAT_DISK_STORES] = "disk_stores",
+    [STAT_TUNNEL_BYTES_UP] = "tunnel_bytes_up",
+    [STAT_TUNNEL_BYTES_DOWN] = "tunnel_bytes_down",
+    [STAT_TIMEOUTS] = "timeouts",
+    [STAT_ORIGIN_BUSY] = "origin_busy",
+    [STAT_LOG_DROPPED] = "log_dropped",
+};
+
+static const char *g_latency_names[LAT_COUNT] = {
+    [LAT_PARSE] = "parse",
+    [LAT_LOOKUP] = "lookup",
+    [LAT_CONNECT] = "connect",
+    [LAT_FIRST_BYTE] = "first_byte",
+    [LAT_TOTAL] = "total",
+};
+
+static int BucketOf(int64_t us);
+static int64_t BucketValue(int index);
+static void ReportLatency(Chain *out, StatLatency lat);
+static void ChainPrintf(Chain *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static int IsLoopback(int connfd);
+static void *DumpThread(void *vargp);
+
+void StatsInit(void)
+{
+    g_started = StatsNow();
+}
+
+StatsSlot *StatsRegister(void)
+{
+    StatsSlot *slot = (StatsSlot *)Calloc(1, sizeof(StatsSlot));
+    pthread_mutex_lock(&g_slots_mutex);
+    slot->next = g_slots;
+    g_slots = slot;
+    pthread_mutex_unlock(&g_slots_mutex);
+    t_stats = slot;
+    return slot;
+}
+
+int64_t StatsNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void StatsRecord(StatLatency lat, int64_t us)
+{
+    StatsSlot *slot = t_stats != NULL ? t_stats : StatsRegister();
+    uint64_t *p = &slot->buckets[lat][BucketOf(us)];
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+void TraceStart(RequestTrace *trace, int64_t start)
+{
+    memset(trace->at, 0, sizeof(trace->at));
+    trace->at[TIME_START] = start;
+    trace->outcome = STAT_ERRORS;
+}
+
+int64_t TraceFinish(RequestTrace *trace)
+{
+    int64_t *at = trace->at;
+    at[TIME_DONE] = StatsNow();
+    StatsAdd(STAT_REQUESTS, 1);
+    StatsAdd(trace->outcome, 1);
+
+    if (at[TIME_PARSED] != 0) {
+        StatsRecord(LAT_PARSE, at[TIME_PARSED] - at[TIME_START]);
+    }
+    if (at[TIME_LOOKED_UP] != 0) {
+        StatsRecord(LAT_LOOKUP, at[TIME_LOOKED_UP] - at[TIME_PARSED]);
+    }
+    if (at[TIME_CONNECTED] != 0) {
+        StatsRecord(LAT_CONNECT, at[TIME_CONNECTED] - at[TIME_LOOKED_UP]);
+    }
+    if (at[TIME_FIRST_BYTE] != 0) {
+        StatsRecord(LAT_FIRST_BYTE, at[TIME_FIRST_BYTE] - at[TIME_START]);
+    }
+    /* how long a tunnel stayed open is up to its ends, it is no latency */
+    if (trace->outcome != STAT_TUNNELS) {
+        StatsRecord(LAT_TOTAL, at[TIME_DONE] - at[TIME_START]);
+    }
+    return at[TIME_DONE] - at[TIME_START];
+}
+
+const char *StatsName(StatCounter c)
+{
+    return g_counter_names[c];
+}
+
+void StatsReport(Chain *out)
+{
+    uint64_t counters[STAT_COUNT] = {0};
+    pthread_mutex_lock(&g_slots_mutex);
+    StatsSlot *slots = g_slots;
+    int64_t started = g_started;
+    pthread_mutex_unlock(&g_slots_mutex);
+
+    /* slots are never freed, the list only grows at its head */
+    for (StatsSlot *slot = slots; slot != NULL; slot = slot->next) {
+        for (int c = 0; c < STAT_COUNT; c++) {
+            counters[c] += __atomic_load_n(&slot->counters[c], __ATOMIC_RELAXED);
+        }
+    }
+
+    ChainPrintf(out, "uptime_s %lld\n", (long long)((StatsNow() - started) / 1000000));
+    for (int c = 0; c < STAT_COUNT; c++) {
+        ChainPrintf(out, "%s %llu\n", g_counter_names[c], (unsigned long long)counters[c]);
+    }
+    uint64_t lookups = counters[STAT_HITS] + counters[STAT_DISK_HITS] + counters[STAT_MISSES] +
+                       counters[STAT_REVALIDATED] + counters[STAT_COALESCED];
+    ChainPrintf(out, "hit_ratio %.4f\n",
+                lookups > 0 ? (double)(counters[STAT_HITS] + counters[STAT_DISK_HITS]) / lookups : 0.0);
+    ChainPrintf(out, "cache_bytes %zu\n", CacheUsage());
+    for (int lat = 0; lat < LAT_COUNT; lat++) {
+        ReportLatency(out, lat);
+    }
+}
+
+void StatsResponse(int connfd, Chain *out)
+{
+    char header[MAXLINE];
+    if (!IsLoopback(connfd)) {
+        int len = snprintf(header, MAXLINE, "HTTP/1.0 403 Forbidden\r\nContent-Length: 0\r\n"
+                           "Connection: close\r\n\r\n");
+        ChainAppend(out, header, len);
+        return;
+    }
+
+    Chain body;
+    ChainInit(&body);
+    StatsReport(&body);
+    int len = snprintf(header, MAXLINE, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+                       "Content-Length: %zu\r\nCache-Control: no-store\r\n\r\n", body.len);
+    ChainAppend(out, header, len);
+    for (Chunk *chunk = body.head; chunk != NULL; chunk = chunk->next) {
+        ChainAppend(out, chunk->data, chunk->len);
+    }
+    ChainFree(&body);
+}
+
+void StatsStartDump(int period)
+{
+    pthread_t tid;
+    Pthread_create(&tid, NULL, DumpThread, (void *)(long)period);
+    Pthread_detach(tid);
+}
+
+static void *DumpThread(void *vargp)
+{
+    int period = (long)vargp;
+    while (1) {
+        sleep(period);
+        Chain report;
+        ChainInit(&report);
+        StatsReport(&report);
+        LogChain("stats", &report);
+        ChainFree(&report);
+    }
+    return NULL;
+}
+
+/**
+ * @brief count, mean and percentiles of lat over all threads, in microseconds
+ */
+static void ReportLatency(Chain *out, StatLatency lat)
+{
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    uint64_t buckets[STATS_BUCKETS] = {0};
+    uint64_t count = 0;
+    double sum = 0;
+
+    pthread_mutex_lock(&g_slots_mutex);
+    StatsSlot *slots = g_slots;
+    pthread_mutex_unlock(&g_slots_mutex);
+    for (StatsSlot *slot = slots; slot != NULL; slot = slot->next) {
+        for (int i = 0; i < STATS_BUCKETS; i++) {
+            buckets[i] += __atomic_load_n(&slot->buckets[lat][i], __ATOMIC_RELAXED);
+        }
+    }
+    int max = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        count += buckets[i];
+        sum += (double)buckets[i] * BucketValue(i);
+        if (buckets[i] > 0) {
+            max = i;
+        }
+    }
+
+    ChainPrintf(out, "latency_us %s count=%llu mean=%.0f", g_latency_names[lat],
+                (unsigned long long)count, count > 0 ? sum / count : 0.0);
+    for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++) {
+        /* value of the bucket that holds the rank-th smallest sample */
+        uint64_t rank = (uint64_t)(percentiles[p] / 100 * count + 0.5);
+        uint64_t seen = 0;
+        int i = 0;
+        while (i < max && seen + buckets[i] < (rank > 0 ? rank : 1)) {
+            seen += buckets[i++];
+        }
+        ChainPrintf(out, " p%g=%lld", percentiles[p], count > 0 ? (long long)BucketValue(i) : 0LL);
+    }
+    ChainPrintf(out, " max=%lld\n", count > 0 ? (long long)BucketValue(max) : 0LL);
+}
+
+/**
+ * @brief values below STATS_SUB_BUCKETS have a bucket each, above that the
+ * top STATS_SUB_BITS bits after the leading one pick the bucket within the
+ * value's power of two
+ */
+static int BucketOf(int64_t us)
+{
+    if (us < STATS_SUB_BUCKETS) {
+        return us < 0 ? 0 : us;
+    }
+    if (us >= (int64_t)1 << (STATS_MAX_EXP + 1)) {
+        us = ((int64_t)1 << (STATS_MAX_EXP + 1)) - 1;
+    }
+    int exp = 63 - __builtin_clzll(us);
+    int sub = (us >> (exp - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return (exp - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+/**
+ * @return middle of the range of values that fall into bucket index
+ */
+static int64_t BucketValue(int index)
+{
+    if (index < STATS_SUB_BUCKETS) {
+        return index;
+    }
+    int exp = index / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    int64_t sub = index % STATS_SUB_BUCKETS;
+    int64_t width = (int64_t)1 << (exp - STATS_SUB_BITS);
+    return (STATS_SUB_BUCKETS + sub) * width + width / 2;
+}
+
+static void ChainPrintf(Chain *out, const char *fmt, ...)
+{
+    char line[MAXLINE];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, MAXLINE, fmt, ap);
+    va_end(ap);
+    ChainAppend(out, line, len < MAXLINE ? len : MAXLINE - 1);
+}
+
+/**
+ * @return 1 if the peer of connfd is on this host
+ */
+static int IsLoopback(int connfd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(connfd, (SA *)&addr, &len) < 0) {
+        return 0;
+    }
+    if (addr.ss_family == AF_INET) {
+        return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr.ss_family == AF_INET6) {
+        struct in6_addr *a = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(a) ||
+               (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+    }
+    return 0;
+}
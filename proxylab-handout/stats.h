@@ -0,0 +1,147 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include "chunk.h"
+
+/**
+ * counters and latency histograms of the proxy. every thread counts into its
+ * own slot, registered on first use; only the owner writes a slot, with
+ * relaxed atomic stores and no locked instructions, and readers sum the slots
+ * of all threads without stopping them.
+ *
+ * latencies go into log-linear histograms in the style of HdrHistogram: every
+ * power of two of microseconds is split into STATS_SUB_BUCKETS equal buckets,
+ * so any percentile read back is within 1/STATS_SUB_BUCKETS of the true value
+ * whatever its magnitude, with a fixed number of buckets.
+ *
+ * the report is served on GET /__stats by both engines, to loopback clients
+ * only, and can be logged periodically.
+ */
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXP 36  // larger latencies (over 19 hours) count as 2^36 us
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_SUB_BITS + 2) * STATS_SUB_BUCKETS)
+#define STATS_PATH "/__stats"
+
+typedef enum {
+    STAT_CONNECTIONS,  // client connections accepted
+    STAT_REQUESTS,     // requests finished, each has one of the outcomes below
+    STAT_HITS,         // outcome: served from memory
+    STAT_DISK_HITS,    // outcome: served from the disk tier
+    STAT_MISSES,       // outcome: fetched from origin
+    STAT_REVALIDATED,  // outcome: stale entry confirmed by origin
+    STAT_COALESCED,    // outcome: streamed from another client's fetch
+    STAT_ADMIN,        // outcome: served by the proxy itself
+    STAT_TUNNELS,      // outcome: CONNECT tunnel, ended
+    STAT_ERRORS,       // outcome: error page, or given up
+    STAT_BYTES_OUT,    // bytes sent to clients
+    STAT_CACHE_INSERTS,
+    STAT_CACHE_REJECTS,   // turned down by admission
+    STAT_CACHE_EVICTIONS,
+    STAT_CACHE_EVICTED_BYTES,
+    STAT_DISK_STORES,
+    STAT_TUNNEL_BYTES_UP,    // client to origin through tunnels
+    STAT_TUNNEL_BYTES_DOWN,  // origin to client through tunnels
+    STAT_TIMEOUTS,     // an origin or a client took too long
+    STAT_ORIGIN_BUSY,  // turned away by the per-origin connection cap
+    STAT_LOG_DROPPED,  // log lines lost to a full ring
+    STAT_COUNT,
+} StatCounter;
+
+typedef enum {
+    LAT_PARSE,       // request start to head parsed
+    LAT_LOOKUP,      // head parsed to cache lookup done
+    LAT_CONNECT,     // lookup done to origin connected, misses only
+    LAT_FIRST_BYTE,  // request start to first response byte sent
+    LAT_TOTAL,       // request start to last response byte sent, tunnels aside
+    LAT_COUNT,
+} StatLatency;
+
+typedef enum {
+    TIME_START,      // connection accepted, or the next request began to arrive
+    TIME_PARSED,
+    TIME_LOOKED_UP,
+    TIME_CONNECTED,
+    TIME_FIRST_BYTE,
+    TIME_DONE,
+    TIME_COUNT,
+} TracePoint;
+
+/* one request on its way through the proxy, timestamps are 0 until reached */
+typedef struct {
+    int64_t at[TIME_COUNT];  // microseconds, StatsNow
+    StatCounter outcome;
+} RequestTrace;
+
+typedef struct StatsSlot {
+    uint64_t counters[STAT_COUNT];
+    uint64_t buckets[LAT_COUNT][STATS_BUCKETS];
+    struct StatsSlot *next;
+} StatsSlot;
+
+extern __thread StatsSlot *t_stats;
+
+/**
+ * @brief start the uptime clock, before any thread counts
+ */
+void StatsInit(void);
+
+StatsSlot *StatsRegister(void);
+
+int64_t StatsNow(void);
+
+/**
+ * @brief add n to counter c of the calling thread
+ */
+static inline void StatsAdd(StatCounter c, uint64_t n)
+{
+    StatsSlot *slot = t_stats != NULL ? t_stats : StatsRegister();
+    uint64_t *p = &slot->counters[c];
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void StatsRecord(StatLatency lat, int64_t us);
+
+/**
+ * @brief start tracing a request that began at start, as an error until
+ * TraceOutcome says otherwise
+ */
+void TraceStart(RequestTrace *trace, int64_t start);
+
+static inline void TraceMark(RequestTrace *trace, TracePoint point)
+{
+    trace->at[point] = StatsNow();
+}
+
+static inline void TraceOutcome(RequestTrace *trace, StatCounter outcome)
+{
+    trace->outcome = outcome;
+}
+
+/**
+ * @brief count the request and record its latencies, marks TIME_DONE
+ * @return its total latency in microseconds
+ */
+int64_t TraceFinish(RequestTrace *trace);
+
+const char *StatsName(StatCounter c);
+
+/**
+ * @brief append a plain text report of every counter and histogram to out
+ */
+void StatsReport(Chain *out);
+
+/**
+ * @brief append the response to GET STATS_PATH to out, only loopback peers
+ * of connfd may see it
+ */
+void StatsResponse(int connfd, Chain *out);
+
+/**
+ * @brief log the report every period seconds from a thread of its own
+ */
+void StatsStartDump(int period);
+
+#endif
@@ -792,6 +792,43 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writevn - Robustly write all the bytes of an iovec array with as
+ *     few writev calls as possible (unbuffered). iov is consumed: entries
+ *     are advanced past what was written
+ */
+ssize_t rio_writevn(int fd, struct iovec *iov, int iovcnt) 
+{
+    size_t n = 0;
+    ssize_t nwritten;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+	n += iov[i].iov_len;
+
+    while (1) {
+	while (iovcnt > 0 && iov->iov_len == 0) { /* Skip what is written */
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt == 0)
+	    break;
+	if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		nwritten = 0;    /* and call writev() again */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	for (; nwritten > 0 && nwritten >= iov->iov_len; iov++, iovcnt--)
+	    nwritten -= iov->iov_len;
+	if (nwritten > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return n;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -911,6 +948,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
 	unix_error("Rio_writen error");
 }
 
+void Rio_writevn(int fd, struct iovec *iov, int iovcnt) 
+{
+    if (rio_writevn(fd, iov, iovcnt) < 0)
+	unix_error("Rio_writevn error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
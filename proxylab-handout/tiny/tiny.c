@@ -5,11 +5,14 @@
  *
  * Updated 11/2019 droh 
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
+ *   - Request heads are parsed in place by the proxy's parser.h.
+ *   - Response headers go out with the body in one writev().
  */
 #include "csapp.h"
+#include "parser.h"
 
 void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+int read_request(int fd, char *buf, HttpParser *parser);
 int parse_uri(char *uri, char *filename, char *cgiargs);
 void serve_static(int fd, char *filename, int filesize);
 void get_filetype(char *filename, char *filetype);
@@ -49,24 +52,29 @@ int main(int argc, char **argv)
 /* $begin doit */
 void doit(int fd) 
 {
-    int is_static;
+    int is_static, rc;
     struct stat sbuf;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char buf[MAXBUF], method[MAXLINE], uri[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
+    HttpParser parser;
 
     /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
+    rc = read_request(fd, buf, &parser);                 //line:netp:doit:readrequest
+    if (rc == HTTP_PARTIAL)
         return;
-    printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
+    if (rc == HTTP_ERROR) {
+        clienterror(fd, "", "400", "Bad Request",
+                    "Tiny could not parse the request");
+        return;
+    }
+    printf("%.*s", (int)parser.off, buf);
+    SliceCopy(parser.method, method, MAXLINE);          //line:netp:doit:parserequest
+    SliceCopy(parser.target, uri, MAXLINE);
     if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
         clienterror(fd, method, "501", "Not Implemented",
                     "Tiny does not implement this method");
         return;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
@@ -99,22 +107,31 @@ void doit(int fd)
 /* $end doit */
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_request - read HTTP request line and headers into buf, a MAXBUF
+ *                buffer, parsing them as they arrive
+ *                return HTTP_DONE, HTTP_ERROR, or HTTP_PARTIAL if the
+ *                client went away
  */
-/* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+/* $begin read_request */
+int read_request(int fd, char *buf, HttpParser *parser) 
 {
-    char buf[MAXLINE];
+    size_t len = 0;
+    ssize_t n;
+    int rc;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-        Rio_readlineb(rp, buf, MAXLINE);
-        printf("%s", buf);
+    HttpParserInit(parser, 0);
+    while ((rc = HttpParse(parser, buf, len)) == HTTP_PARTIAL) { //line:netp:readhdrs:checkterm
+        if (len == MAXBUF)
+            return HTTP_ERROR;
+        if ((n = read(fd, buf + len, MAXBUF - len)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return HTTP_PARTIAL;
+        len += n;
     }
-    return;
+    return rc;
 }
-/* $end read_requesthdrs */
+/* $end read_request */
 
 /*
  * parse_uri - parse URI into filename and CGI args
@@ -152,31 +169,34 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - copy a file back to the client, headers and file
+ *                in one writev()
  */
 /* $begin serve_static */
 void serve_static(int fd, char *filename, int filesize)
 {
     int srcfd;
     char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    struct iovec iov[2];
 
-    /* Send response headers to client */
+    /* Build response headers */
     get_filetype(filename, filetype);    //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); //line:netp:servestatic:beginserve
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n", filesize);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: %s\r\n\r\n", filetype);
-    Rio_writen(fd, buf, strlen(buf));    //line:netp:servestatic:endserve
+    iov[0].iov_base = buf;               //line:netp:servestatic:beginserve
+    iov[0].iov_len = snprintf(buf, MAXBUF, "HTTP/1.0 200 OK\r\n"
+                              "Server: Tiny Web Server\r\n"
+                              "Content-length: %d\r\n"
+                              "Content-type: %s\r\n\r\n",
+                              filesize, filetype); //line:netp:servestatic:endserve
 
-    /* Send response body to client */
+    /* Send response headers and body to client */
     srcfd = Open(filename, O_RDONLY, 0); //line:netp:servestatic:open
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0); //line:netp:servestatic:mmap
+    srcp = filesize > 0 ? Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0) : NULL; //line:netp:servestatic:mmap
     Close(srcfd);                       //line:netp:servestatic:close
-    Rio_writen(fd, srcp, filesize);     //line:netp:servestatic:write
-    Munmap(srcp, filesize);             //line:netp:servestatic:munmap
+    iov[1].iov_base = srcp;
+    iov[1].iov_len = filesize;
+    Rio_writevn(fd, iov, 2);            //line:netp:servestatic:write
+    if (srcp)
+        Munmap(srcp, filesize);         //line:netp:servestatic:munmap
 }
 
 /*
@@ -228,24 +248,25 @@ void serve_dynamic(int fd, char *filename, char *cgiargs)
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg) 
 {
-    char buf[MAXLINE];
+    char header[MAXLINE], body[2 * MAXLINE];  /* cause is at most a MAXLINE string */
+    struct iovec iov[2];
 
-    /* Print the HTTP response headers */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    /* Build the HTTP response headers */
+    iov[0].iov_base = header;
+    iov[0].iov_len = snprintf(header, MAXLINE, "HTTP/1.0 %s %s\r\n"
+                              "Content-type: text/html\r\n\r\n",
+                              errnum, shortmsg);
 
-    /* Print the HTTP response body */
-    sprintf(buf, "<html><title>Tiny Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<body bgcolor=""ffffff"">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<hr><em>The Tiny Web server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    /* Build the HTTP response body */
+    iov[1].iov_base = body;
+    iov[1].iov_len = snprintf(body, sizeof(body), "<html><title>Tiny Error</title>"
+                              "<body bgcolor=""ffffff"">\r\n"
+                              "%s: %s\r\n"
+                              "<p>%s: %s\r\n"
+                              "<hr><em>The Tiny Web server</em>\r\n",
+                              errnum, shortmsg, longmsg, cause);
+
+    /* Send both at once */
+    Rio_writevn(fd, iov, 2);
 }
 /* $end clienterror */
@@ -0,0 +1,348 @@
+#include <poll.h>
+#include "csapp.h"
+#include "upstream.h"
+#include "dns.h"
+
+Timeouts g_timeouts = {DEFAULT_CONNECT_TIMEOUT, DEFAULT_IO_TIMEOUT, DEFAULT_IO_TIMEOUT,
+                       DEFAULT_TOTAL_TIMEOUT, DEFAULT_TUNNEL_TIMEOUT};
+
+static Origin *g_origins[UPSTREAM_BUCKETS];
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;  // guards g_origins
+static int g_idle_timeout;
+static int g_max_per_origin;
+static long g_tunnel_ports[MAX_TUNNEL_PORTS] = {DEFAULT_TUNNEL_PORT};  // set before any thread starts
+static int g_ntunnel_ports = 1;  // -1 for any port
+
+static void *Reaper(void *vargp);
+static Origin *FindOrigin(char *key, int create);
+static int IsAlive(int fd);
+static int Dial(char *hostname, char *port);
+static int ConnectTimed(const DnsResult *result);
+static long ParsePort(const char *port);
+
+void UpstreamInit(int idle_timeout, int max_per_origin)
+{
+    g_idle_timeout = idle_timeout;
+    g_max_per_origin = max_per_origin;
+    /* the reaper also drops origins that are no longer in use */
+    pthread_t tid;
+    Pthread_create(&tid, NULL, Reaper, NULL);
+}
+
+int UpstreamAcquire(char *hostname, char *port, int *reused)
+{
+    char key[MAXLINE];
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+
+    pthread_mutex_lock(&g_mutex);
+    Origin *origin = FindOrigin(key, 1);
+    if (g_max_per_origin > 0 && origin->active >= g_max_per_origin) {
+        pthread_mutex_unlock(&g_mutex);
+        return UPSTREAM_BUSY;
+    }
+    origin->active++;
+    *reused = 1;
+    while (origin->idle != NULL) {
+        IdleConn *conn = origin->idle;
+        origin->idle = conn->next;
+        origin->nidle--;
+
+        int fd = conn->fd;
+        Free(conn);
+        if (IsAlive(fd)) {
+            pthread_mutex_unlock(&g_mutex);
+            return fd;
+        }
+        close(fd);
+    }
+    pthread_mutex_unlock(&g_mutex);
+    *reused = 0;
+    return Dial(hostname, port);
+}
+
+int UpstreamConnect(char *hostname, char *port)
+{
+    if (UpstreamReserve(hostname, port) < 0) {
+        return UPSTREAM_BUSY;
+    }
+    return Dial(hostname, port);
+}
+
+void UpstreamRelease(char *hostname, char *port, int fd)
+{
+    char key[MAXLINE];
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+
+    pthread_mutex_lock(&g_mutex);
+    Origin *origin = FindOrigin(key, 1);
+    origin->active--;
+    if (g_idle_timeout <= 0 || origin->nidle >= MAX_IDLE_PER_ORIGIN) {
+        pthread_mutex_unlock(&g_mutex);
+        close(fd);
+        return;
+    }
+
+    IdleConn *conn = (IdleConn *)Malloc(sizeof(IdleConn));
+    conn->fd = fd;
+    conn->since = time(NULL);
+    conn->next = origin->idle;
+    origin->idle = conn;
+    origin->nidle++;
+    pthread_mutex_unlock(&g_mutex);
+}
+
+void UpstreamDiscard(char *hostname, char *port, int fd)
+{
+    close(fd);
+    UpstreamUnreserve(hostname, port);
+}
+
+int UpstreamReserve(char *hostname, char *port)
+{
+    char key[MAXLINE];
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+
+    pthread_mutex_lock(&g_mutex);
+    Origin *origin = FindOrigin(key, 1);
+    if (g_max_per_origin > 0 && origin->active >= g_max_per_origin) {
+        pthread_mutex_unlock(&g_mutex);
+        return UPSTREAM_BUSY;
+    }
+    origin->active++;
+    pthread_mutex_unlock(&g_mutex);
+    return 0;
+}
+
+void UpstreamUnreserve(char *hostname, char *port)
+{
+    char key[MAXLINE];
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+
+    pthread_mutex_lock(&g_mutex);
+    FindOrigin(key, 1)->active--;
+    pthread_mutex_unlock(&g_mutex);
+}
+
+int UpstreamTunnelPorts(char *ports)
+{
+    if (strcmp(ports, "*") == 0) {
+        g_ntunnel_ports = -1;
+        return 0;
+    }
+
+    char list[MAXLINE];
+    snprintf(list, MAXLINE, "%s", ports);
+    int n = 0;
+    char *save;
+    for (char *port = strtok_r(list, ",", &save); port != NULL; port = strtok_r(NULL, ",", &save)) {
+        long number = ParsePort(port);
+        if (number < 0 || n == MAX_TUNNEL_PORTS) {
+            return -1;
+        }
+        g_tunnel_ports[n++] = number;
+    }
+    if (n == 0) {
+        return -1;
+    }
+    g_ntunnel_ports = n;
+    return 0;
+}
+
+int UpstreamTunnelAllowed(const char *port)
+{
+    long number = ParsePort(port);
+    if (number < 0) {
+        return 0;
+    }
+    if (g_ntunnel_ports < 0) {
+        return 1;
+    }
+    for (int i = 0; i < g_ntunnel_ports; i++) {
+        if (g_tunnel_ports[i] == number) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void SocketTimeouts(int fd)
+{
+    struct timeval read = {g_timeouts.read, 0};
+    struct timeval write = {g_timeouts.write, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &read, sizeof(read));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &write, sizeof(write));
+}
+
+/**
+ * @brief once a second, close connections idle for longer than g_idle_timeout
+ * and drop origins left without connections
+ */
+static void *Reaper(void *vargp)
+{
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        sleep(1);
+        time_t deadline = time(NULL) - g_idle_timeout;
+
+        pthread_mutex_lock(&g_mutex);
+        for (int i = 0; i < UPSTREAM_BUCKETS; i++) {
+            Origin **olink = &g_origins[i];
+            while (*olink != NULL) {
+                Origin *origin = *olink;
+
+                IdleConn **link = &origin->idle;
+                while (*link != NULL) {
+                    IdleConn *conn = *link;
+                    if (conn->since <= deadline) {
+                        *link = conn->next;
+                        origin->nidle--;
+                        close(conn->fd);
+                        Free(conn);
+                    } else {
+                        link = &conn->next;
+                    }
+                }
+
+                if (origin->idle == NULL && origin->active == 0) {
+                    *olink = origin->next;
+                    Free(origin->key);
+                    Free(origin);
+                } else {
+                    olink = &origin->next;
+                }
+            }
+        }
+        pthread_mutex_unlock(&g_mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief caller must hold g_mutex
+ */
+static Origin *FindOrigin(char *key, int create)
+{
+    unsigned long hash = 5381;
+    for (char *p = key; *p != '\0'; p++) {
+        hash = hash * 33 + (unsigned char)*p;
+    }
+
+    Origin **bucket = &g_origins[hash & (UPSTREAM_BUCKETS - 1)];
+    for (Origin *origin = *bucket; origin != NULL; origin = origin->next) {
+        if (strcmp(origin->key, key) == 0) {
+            return origin;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    Origin *origin = (Origin *)Malloc(sizeof(Origin));
+    origin->key = strdup(key);
+    origin->idle = NULL;
+    origin->nidle = 0;
+    origin->active = 0;
+    origin->next = *bucket;
+    *bucket = origin;
+    return origin;
+}
+
+/**
+ * @brief an idle connection must have nothing to read, if it is readable the
+ * origin has closed it (or sent garbage) and it can not be reused
+ */
+static int IsAlive(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 0;
+}
+
+/**
+ * @brief connect to host:port, already reserved, and give the reservation
+ * back if that fails. a resolver that hangs counts as a connect timeout
+ */
+static int Dial(char *hostname, char *port)
+{
+    DnsResult result;
+    int fd;
+    switch (DnsResolve(hostname, port, &result, g_timeouts.connect)) {
+    case DNS_RESOLVED:
+        fd = ConnectTimed(&result);
+        break;
+    case DNS_PENDING:
+        fd = UPSTREAM_TIMEOUT;
+        break;
+    default:
+        fd = UPSTREAM_FAILED;
+        break;
+    }
+    if (fd < 0) {
+        UpstreamUnreserve(hostname, port);
+    }
+    return fd;
+}
+
+/**
+ * @brief connect to the addresses of result in turn until one accepts, giving
+ * up after g_timeouts.connect in all, and apply the read and write timeouts
+ * @return a blocking connected descriptor, UPSTREAM_FAILED or UPSTREAM_TIMEOUT
+ */
+static int ConnectTimed(const DnsResult *result)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int fd;
+    for (int i = 0; (fd = DnsConnect(result, &i, 1)) >= 0; i++) {
+        int timeout = -1;
+        if (g_timeouts.connect > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout = g_timeouts.connect * 1000 - (int)((now.tv_sec - start.tv_sec) * 1000 +
+                                                        (now.tv_nsec - start.tv_nsec) / 1000000);
+            if (timeout < 0) {
+                timeout = 0;
+            }
+        }
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        int rc;
+        while ((rc = poll(&pfd, 1, timeout)) < 0 && errno == EINTR) {
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (rc == 0) {
+            close(fd);
+            return UPSTREAM_TIMEOUT;
+        }
+        if (rc < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            /* refused or unreachable, go on with the next address */
+            close(fd);
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        SocketTimeouts(fd);
+        return fd;
+    }
+    return UPSTREAM_FAILED;
+}
+
+/**
+ * @return port as a number from 1 to 65535, or -1 if it is not one
+ */
+static long ParsePort(const char *port)
+{
+    if (!isdigit((unsigned char)port[0])) {
+        return -1;
+    }
+    char *end;
+    long number = strtol(port, &end, 10);
+    return *end == '\0' && number >= 1 && number <= 65535 ? number : -1;
+}
@@ -0,0 +1,120 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <time.h>
+
+/**
+ * pool of idle keep-alive connections to origin servers, keyed by host:port.
+ * a worker takes a connection with UpstreamAcquire, and gives it back with
+ * UpstreamRelease once the response has been read completely, or closes it
+ * with UpstreamDiscard; a reaper thread closes connections that stayed idle
+ * longer than the idle timeout.
+ *
+ * a slow or hung origin is kept from taking every worker down with it: the
+ * connections in use per origin are capped, so requests beyond the cap fail
+ * at once, and no connect, read or write waits longer than g_timeouts says.
+ */
+
+#define UPSTREAM_BUCKETS 256  // must be a power of 2
+#define MAX_IDLE_PER_ORIGIN 16
+#define DEFAULT_IDLE_TIMEOUT 4  // seconds, below common server keep-alive timeouts
+#define DEFAULT_MAX_PER_ORIGIN 64  // connections in use, 0 for no cap
+#define DEFAULT_CONNECT_TIMEOUT 5
+#define DEFAULT_IO_TIMEOUT 30
+#define DEFAULT_TOTAL_TIMEOUT 300
+#define DEFAULT_TUNNEL_TIMEOUT 300
+#define DEFAULT_TUNNEL_PORT 443  // CONNECT is for TLS unless told otherwise
+#define MAX_TUNNEL_PORTS 64
+
+/* failures of UpstreamAcquire */
+#define UPSTREAM_FAILED -1   // not resolved or refused, answer 502
+#define UPSTREAM_TIMEOUT -2  // lookup or connect timed out, answer 504
+#define UPSTREAM_BUSY -3     // origin at its cap, answer 503
+
+/* seconds, 0 waits forever */
+typedef struct {
+    int connect;  // for an origin to accept a connection
+    int read;     // for the next byte from an origin or a client
+    int write;    // for an origin or a client to take the next byte
+    int total;    // for a whole response, from sending the request on
+    int tunnel;   // for a byte either way through a CONNECT tunnel
+} Timeouts;
+
+extern Timeouts g_timeouts;
+
+typedef struct IdleConn {
+    int fd;
+    time_t since;
+    struct IdleConn *next;
+} IdleConn;
+
+typedef struct Origin {
+    char *key;  // "host:port"
+    IdleConn *idle;  // most recently released first
+    int nidle;
+    int active;  // connections in use, counted against the cap
+    struct Origin *next;
+} Origin;
+
+/**
+ * @param idle_timeout seconds a connection may stay idle, 0 disables pooling
+ * @param max_per_origin connections in use per origin, 0 for no cap
+ */
+void UpstreamInit(int idle_timeout, int max_per_origin);
+
+/**
+ * @brief connection with g_timeouts applied, reused if possible
+ * @param reused[out] 1 if it comes from the pool, the origin may have closed
+ * it meanwhile all the same
+ * @return a connected descriptor, or UPSTREAM_FAILED, UPSTREAM_TIMEOUT or
+ * UPSTREAM_BUSY
+ */
+int UpstreamAcquire(char *hostname, char *port, int *reused);
+
+/**
+ * @brief new connection, never one from the pool, counted against the cap
+ * until UpstreamRelease or UpstreamDiscard
+ * @return as UpstreamAcquire
+ */
+int UpstreamConnect(char *hostname, char *port);
+
+/**
+ * @brief hand fd back for reuse, it must sit right after a complete response
+ */
+void UpstreamRelease(char *hostname, char *port, int fd);
+
+/**
+ * @brief close fd, taken with UpstreamAcquire, instead of reusing it
+ */
+void UpstreamDiscard(char *hostname, char *port, int fd);
+
+/**
+ * @brief count a connection to host:port against its cap, for callers that
+ * connect by themselves
+ * @return 0, or UPSTREAM_BUSY
+ */
+int UpstreamReserve(char *hostname, char *port);
+
+void UpstreamUnreserve(char *hostname, char *port);
+
+/**
+ * @brief set the ports CONNECT may tunnel to, DEFAULT_TUNNEL_PORT until
+ * then. a tunnel to any port would let anyone relay mail or reach services
+ * behind the proxy
+ * @param ports comma separated port numbers, or "*" for any port
+ * @return 0, or -1 if ports is not such a list
+ */
+int UpstreamTunnelPorts(char *ports);
+
+/**
+ * @return 1 if CONNECT may tunnel to port
+ */
+int UpstreamTunnelAllowed(const char *port);
+
+/**
+ * @brief let blocking reads and writes on fd fail with EAGAIN after the
+ * g_timeouts read and write timeouts
+ */
+void SocketTimeouts(int fd);
+
+#endif